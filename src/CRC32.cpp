@@ -0,0 +1,166 @@
+#include <intrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+
+// NOTE: CRC-32 as used by zip, with the reflected polynomial 0xedb88320.
+// Buffers of 64 bytes or more are folded with carry-less multiplies where the
+// CPU has PCLMULQDQ (Gopal et al., "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction", using Chromium's constants), and
+// everything else goes through slice-by-8 tables.
+struct CRC32Tables {
+    u32 table[8][256];
+};
+
+CRC32Tables&
+getCRC32Tables() {
+    static CRC32Tables tables = []() {
+        CRC32Tables t;
+        for (u32 i = 0; i < 256; i++) {
+            u32 crc = i;
+            for (u32 bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+            }
+            t.table[0][i] = crc;
+        }
+        for (u32 i = 0; i < 256; i++) {
+            for (u32 slice = 1; slice < 8; slice++) {
+                u32 previous = t.table[slice - 1][i];
+                t.table[slice][i] = (previous >> 8) ^ t.table[0][previous & 0xff];
+            }
+        }
+        return t;
+    }();
+    return tables;
+}
+
+// Takes and returns the CRC without the final inversion, like crc32PCLMUL.
+u32
+crc32SliceBy8(
+    u32 crc,
+    const u8* data,
+    u64 length
+) {
+    auto& t = getCRC32Tables().table;
+    while (length >= 8) {
+        u32 one;
+        u32 two;
+        memcpy(&one, data, 4);
+        memcpy(&two, data + 4, 4);
+        one ^= crc;
+        crc = t[7][one & 0xff] ^
+            t[6][(one >> 8) & 0xff] ^
+            t[5][(one >> 16) & 0xff] ^
+            t[4][one >> 24] ^
+            t[3][two & 0xff] ^
+            t[2][(two >> 8) & 0xff] ^
+            t[1][(two >> 16) & 0xff] ^
+            t[0][two >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+// Folds four 128-bit lanes at a time, then one, then reduces to 32 bits.
+// length must be a multiple of 16 and at least 64.
+u32
+crc32PCLMUL(
+    u32 crc,
+    const u8* data,
+    u64 length
+) {
+    alignas(16) static const u64 k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const u64 k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const u64 k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    alignas(16) static const u64 poly[] = { 0x01db710641, 0x01f7011641 };
+
+    __m128i x1 = _mm_loadu_si128((__m128i*)(data + 0x00));
+    __m128i x2 = _mm_loadu_si128((__m128i*)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((__m128i*)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((__m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    __m128i k = _mm_load_si128((__m128i*)k1k2);
+    data += 64;
+    length -= 64;
+
+    while (length >= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((__m128i*)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((__m128i*)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((__m128i*)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((__m128i*)(data + 0x30)));
+        data += 64;
+        length -= 64;
+    }
+
+    // Fold the four lanes into one.
+    k = _mm_load_si128((__m128i*)k3k4);
+    __m128i lanes[] = { x2, x3, x4 };
+    for (u32 i = 0; i < 3; i++) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, lanes[i]), x5);
+    }
+    while (length >= 16) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((__m128i*)data)), x5);
+        data += 16;
+        length -= 16;
+    }
+
+    // 128 bits to 64.
+    __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    k = _mm_loadl_epi64((__m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits.
+    k = _mm_load_si128((__m128i*)poly);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (u32)_mm_extract_epi32(x1, 1);
+}
+
+bool
+hasPCLMUL() {
+    static bool supported = []() {
+        int info[4];
+        __cpuid(info, 1);
+        bool pclmul = (info[2] & (1 << 1)) != 0;
+        bool sse41 = (info[2] & (1 << 19)) != 0;
+        return pclmul && sse41;
+    }();
+    return supported;
+}
+
+// Continues crc over length more bytes. Start from 0.
+u32
+updateCRC32(
+    u32 crc,
+    const u8* data,
+    u64 length
+) {
+    crc = ~crc;
+    if (length >= 64 && hasPCLMUL()) {
+        u64 folded = length & ~(u64)15;
+        crc = crc32PCLMUL(crc, data, folded);
+        data += folded;
+        length -= folded;
+    }
+    return ~crc32SliceBy8(crc, data, length);
+}
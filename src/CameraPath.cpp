@@ -0,0 +1,102 @@
+// NOTE: A camera path is a text file naming the map on its first line and
+// holding one camera per frame after that: eye x y z w, then the X and Y
+// rotation in degrees. Replaying a recorded path puts the same views in front
+// of the renderer on every run, which is what makes culling numbers
+// comparable.
+struct CameraKey {
+    Vec4 eye;
+    float rotX;
+    float rotY;
+};
+
+struct CameraPath {
+    char map[64];
+    CameraKey* keys;
+    u32 position;
+    FILE* file;
+};
+
+bool
+loadCameraPath(
+    const char* path,
+    CameraPath& cameraPath
+) {
+    cameraPath = {};
+    FILE* file;
+    if (fopen_s(&file, path, "r") != 0) {
+        ERR("could not open camera path '%s'", path);
+        return false;
+    }
+    if (fscanf_s(file, "map %63s", cameraPath.map, (unsigned)sizeof(cameraPath.map)) != 1) {
+        ERR("camera path '%s' does not name a map", path);
+        fclose(file);
+        return false;
+    }
+    CameraKey key;
+    while (fscanf_s(
+        file,
+        "%f %f %f %f %f %f",
+        &key.eye.x, &key.eye.y, &key.eye.z, &key.eye.w,
+        &key.rotX, &key.rotY
+    ) == 6) {
+        arrput(cameraPath.keys, key);
+    }
+    fclose(file);
+    INFO("Camera path '%s': %u frames on '%s'", path, (u32)arrlenu(cameraPath.keys), cameraPath.map);
+    return arrlen(cameraPath.keys) > 0;
+}
+
+// Returns false once the path has run out.
+bool
+nextCameraKey(
+    CameraPath& cameraPath,
+    CameraKey& key
+) {
+    if (cameraPath.position >= arrlenu(cameraPath.keys)) {
+        return false;
+    }
+    key = cameraPath.keys[cameraPath.position++];
+    return true;
+}
+
+bool
+startCameraRecording(
+    const char* path,
+    const char* map,
+    CameraPath& cameraPath
+) {
+    cameraPath = {};
+    if (fopen_s(&cameraPath.file, path, "w") != 0) {
+        ERR("could not create camera path '%s'", path);
+        cameraPath.file = nullptr;
+        return false;
+    }
+    strncpy_s(cameraPath.map, map, sizeof(cameraPath.map) - 1);
+    fprintf(cameraPath.file, "map %s\n", map);
+    INFO("Recording camera path to '%s'", path);
+    return true;
+}
+
+void
+recordCameraKey(
+    CameraPath& cameraPath,
+    CameraKey& key
+) {
+    fprintf(
+        cameraPath.file,
+        "%.3f %.3f %.3f %.3f %.3f %.3f\n",
+        key.eye.x, key.eye.y, key.eye.z, key.eye.w,
+        key.rotX, key.rotY
+    );
+}
+
+void
+closeCameraPath(
+    CameraPath& cameraPath
+) {
+    if (cameraPath.file != nullptr) {
+        fclose(cameraPath.file);
+    }
+    arrfree(cameraPath.keys);
+    cameraPath = {};
+}
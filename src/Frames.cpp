@@ -0,0 +1,316 @@
+// NOTE: Each frame in flight owns its uniform buffer, its synchronization
+// objects, its command buffer and (through the map) its descriptor sets. The
+// CPU only blocks when it laps the GPU by the full ring depth.
+struct Frame {
+    VkFence fence;
+    // Draws depend on what is visible, so the command buffer is recorded anew
+    // each frame. Resetting the whole pool once the fence has signaled is
+    // cheaper than resetting buffers one by one.
+    VkCommandPool cmdPool;
+    VkCommandBuffer cmd;
+    // The draws themselves go into secondary command buffers, one per batch,
+    // each with its own pool so batches can be recorded on different threads.
+    VkCommandPool* batchPools;
+    VkCommandBuffer* batchCmds;
+    VkSemaphore imageAcquired;
+    VkSemaphore renderFinished;
+    VulkanBuffer uniforms;
+    void* mappedUniforms;
+};
+
+struct FrameStats {
+    i64 windowStart;
+    u32 frames;
+    i64 frameTicks;
+    i64 maxFrameTicks;
+    i64 fenceWaitTicks;
+    i64 maxFenceWaitTicks;
+    i64 acquireTicks;
+    i64 paceTicks;
+    i64 recordTicks;
+    i64 maxRecordTicks;
+    i64 latencyTicks;
+    i64 maxLatencyTicks;
+    i64 intervalTicks;
+    i64 maxIntervalTicks;
+};
+
+struct FrameRing {
+    Frame* frames;
+    u32 depth;
+    u32 batchCount;
+    u32 index;
+    u32 imageIndex;
+    u64 count;
+    i64 lastPresent;
+    i64 lastPaced;
+    FrameStats stats;
+};
+
+enum FramePacing {
+    // Submit as soon as a frame slot is free.
+    PACING_NONE,
+    // Wait for the previous frame to finish on the GPU before sampling input,
+    // trading throughput for the shortest input-to-present latency.
+    PACING_PRESENT,
+};
+
+void
+createFrameRing(
+    Vulkan& vk,
+    u32 depth,
+    VkDeviceSize uniformSize,
+    u32 batchCount,
+    FrameRing& ring
+) {
+    ring = {};
+    ring.depth = depth;
+    ring.batchCount = batchCount;
+    arrsetlen(ring.frames, depth);
+    for (u32 i = 0; i < depth; i++) {
+        auto& frame = ring.frames[i];
+        frame = {};
+
+        VkFenceCreateInfo fenceInfo = {};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+        VKCHECK(vkCreateFence(vk.device, &fenceInfo, nullptr, &frame.fence));
+
+        VkSemaphoreCreateInfo semaphoreInfo = {};
+        semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        VKCHECK(vkCreateSemaphore(vk.device, &semaphoreInfo, nullptr, &frame.imageAcquired));
+        VKCHECK(vkCreateSemaphore(vk.device, &semaphoreInfo, nullptr, &frame.renderFinished));
+
+        VkCommandPoolCreateInfo poolInfo = {};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        poolInfo.queueFamilyIndex = vk.queueFamily;
+        VKCHECK(vkCreateCommandPool(vk.device, &poolInfo, nullptr, &frame.cmdPool));
+        createCommandBuffers(vk.device, frame.cmdPool, 1, &frame.cmd);
+
+        arrsetlen(frame.batchPools, batchCount);
+        arrsetlen(frame.batchCmds, batchCount);
+        for (u32 b = 0; b < batchCount; b++) {
+            VKCHECK(vkCreateCommandPool(vk.device, &poolInfo, nullptr, &frame.batchPools[b]));
+            VkCommandBufferAllocateInfo allocInfo = {};
+            allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            allocInfo.commandPool = frame.batchPools[b];
+            allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            allocInfo.commandBufferCount = 1;
+            VKCHECK(vkAllocateCommandBuffers(vk.device, &allocInfo, &frame.batchCmds[b]));
+        }
+
+        createBuffer(
+            vk,
+            uniformSize,
+            VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            frame.uniforms
+        );
+        VKCHECK(vkMapMemory(
+            vk.device,
+            frame.uniforms.memory,
+            0,
+            uniformSize,
+            0,
+            &frame.mappedUniforms
+        ));
+    }
+    INFO("%u frames in flight, up to %u draw batches each", depth, batchCount);
+}
+
+void
+destroyFrameRing(
+    Vulkan& vk,
+    FrameRing& ring
+) {
+    for (u32 i = 0; i < ring.depth; i++) {
+        auto& frame = ring.frames[i];
+        vkUnmapMemory(vk.device, frame.uniforms.memory);
+        destroyBuffer(vk, frame.uniforms);
+        vkDestroyCommandPool(vk.device, frame.cmdPool, nullptr);
+        for (u32 b = 0; b < ring.batchCount; b++) {
+            vkDestroyCommandPool(vk.device, frame.batchPools[b], nullptr);
+        }
+        arrfree(frame.batchPools);
+        arrfree(frame.batchCmds);
+        vkDestroySemaphore(vk.device, frame.renderFinished, nullptr);
+        vkDestroySemaphore(vk.device, frame.imageAcquired, nullptr);
+        vkDestroyFence(vk.device, frame.fence, nullptr);
+    }
+    arrfree(ring.frames);
+}
+
+// Waits until the next frame slot is free and acquires a swapchain image for
+// it. Time spent blocked is added to the frame stats.
+Frame&
+beginFrame(
+    Vulkan& vk,
+    FrameRing& ring
+) {
+    auto& frame = ring.frames[ring.index];
+
+    LARGE_INTEGER start, waited, acquired;
+    QueryPerformanceCounter(&start);
+    VKCHECK(vkWaitForFences(vk.device, 1, &frame.fence, VK_TRUE, UINT64_MAX));
+    QueryPerformanceCounter(&waited);
+    VKCHECK(vkResetCommandPool(vk.device, frame.cmdPool, 0));
+    for (u32 b = 0; b < ring.batchCount; b++) {
+        VKCHECK(vkResetCommandPool(vk.device, frame.batchPools[b], 0));
+    }
+    VKCHECK(vkAcquireNextImageKHR(
+        vk.device,
+        vk.swap.handle,
+        UINT64_MAX,
+        frame.imageAcquired,
+        VK_NULL_HANDLE,
+        &ring.imageIndex
+    ));
+    QueryPerformanceCounter(&acquired);
+
+    auto fenceWait = waited.QuadPart - start.QuadPart;
+    ring.stats.fenceWaitTicks += fenceWait;
+    if (fenceWait > ring.stats.maxFenceWaitTicks) {
+        ring.stats.maxFenceWaitTicks = fenceWait;
+    }
+    ring.stats.acquireTicks += acquired.QuadPart - waited.QuadPart;
+
+    return frame;
+}
+
+// Blocks before a frame starts according to the pacing mode and frame cap.
+// A maxFPS of 0 means no cap.
+void
+paceFrame(
+    Vulkan& vk,
+    FrameRing& ring,
+    FramePacing pacing,
+    u32 maxFPS
+) {
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+
+    if (pacing == PACING_PRESENT && ring.count > 0) {
+        auto previous = (ring.index + ring.depth - 1) % ring.depth;
+        VKCHECK(vkWaitForFences(vk.device, 1, &ring.frames[previous].fence, VK_TRUE, UINT64_MAX));
+    }
+
+    if (maxFPS > 0 && ring.lastPaced != 0) {
+        i64 target = ring.lastPaced + counterFrequency.QuadPart / maxFPS;
+        QueryPerformanceCounter(&end);
+        // Sleep for the bulk of the wait and spin for the last two
+        // milliseconds, since Sleep is only accurate to the timer period.
+        i64 sleepTicks = target - end.QuadPart - counterFrequency.QuadPart * 2 / 1000;
+        if (sleepTicks > 0) {
+            Sleep((DWORD)(sleepTicks * 1000 / counterFrequency.QuadPart));
+        }
+        do {
+            QueryPerformanceCounter(&end);
+        } while (end.QuadPart < target);
+        // Schedule against the ideal time, unless we fell more than a frame
+        // behind, so that the cap does not drift.
+        ring.lastPaced = end.QuadPart - target > counterFrequency.QuadPart / maxFPS
+            ? end.QuadPart
+            : target;
+    } else {
+        QueryPerformanceCounter(&end);
+        ring.lastPaced = end.QuadPart;
+    }
+
+    ring.stats.paceTicks += end.QuadPart - start.QuadPart;
+}
+
+void
+submitFrame(
+    Vulkan& vk,
+    FrameRing& ring,
+    VkCommandBuffer cmd
+) {
+    auto& frame = ring.frames[ring.index];
+    VKCHECK(vkResetFences(vk.device, 1, &frame.fence));
+
+    VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.waitSemaphoreCount = 1;
+    submitInfo.pWaitSemaphores = &frame.imageAcquired;
+    submitInfo.pWaitDstStageMask = &waitStage;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cmd;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &frame.renderFinished;
+    VKCHECK(vkQueueSubmit(vk.queue, 1, &submitInfo, frame.fence));
+
+    VkPresentInfoKHR presentInfo = {};
+    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    presentInfo.waitSemaphoreCount = 1;
+    presentInfo.pWaitSemaphores = &frame.renderFinished;
+    presentInfo.swapchainCount = 1;
+    presentInfo.pSwapchains = &vk.swap.handle;
+    presentInfo.pImageIndices = &ring.imageIndex;
+    VKCHECK(vkQueuePresentKHR(vk.queue, &presentInfo));
+
+    ring.index = (ring.index + 1) % ring.depth;
+    ring.count++;
+}
+
+// Accumulates a frame's duration, its input-to-present latency and the
+// interval since the previous present, and logs them about once a second.
+void
+recordFrameStats(
+    FrameRing& ring,
+    i64 frameTicks,
+    i64 latencyTicks,
+    i64 presentTime
+) {
+    auto& stats = ring.stats;
+    i64 now = presentTime;
+    if (stats.windowStart == 0) {
+        stats.windowStart = now;
+    }
+    stats.frames++;
+    stats.frameTicks += frameTicks;
+    if (frameTicks > stats.maxFrameTicks) {
+        stats.maxFrameTicks = frameTicks;
+    }
+    stats.latencyTicks += latencyTicks;
+    if (latencyTicks > stats.maxLatencyTicks) {
+        stats.maxLatencyTicks = latencyTicks;
+    }
+    if (ring.lastPresent != 0) {
+        i64 interval = presentTime - ring.lastPresent;
+        stats.intervalTicks += interval;
+        if (interval > stats.maxIntervalTicks) {
+            stats.maxIntervalTicks = interval;
+        }
+    }
+    ring.lastPresent = presentTime;
+
+    if (now - stats.windowStart < counterFrequency.QuadPart) {
+        return;
+    }
+
+    double toMS = 1000.0 / counterFrequency.QuadPart;
+    INFO(
+        "frames: %u, avg %.2f ms, max %.2f ms, fence wait avg %.3f ms max %.3f ms, acquire avg %.3f ms, pacing avg %.3f ms, record avg %.3f ms max %.3f ms (%u in flight)",
+        stats.frames,
+        stats.frameTicks * toMS / stats.frames,
+        stats.maxFrameTicks * toMS,
+        stats.fenceWaitTicks * toMS / stats.frames,
+        stats.maxFenceWaitTicks * toMS,
+        stats.acquireTicks * toMS / stats.frames,
+        stats.paceTicks * toMS / stats.frames,
+        stats.recordTicks * toMS / stats.frames,
+        stats.maxRecordTicks * toMS,
+        ring.depth
+    );
+    INFO(
+        "latency: input to present avg %.3f ms max %.3f ms, present interval avg %.2f ms max %.2f ms",
+        stats.latencyTicks * toMS / stats.frames,
+        stats.maxLatencyTicks * toMS,
+        stats.intervalTicks * toMS / stats.frames,
+        stats.maxIntervalTicks * toMS
+    );
+    stats = {};
+    stats.windowStart = now;
+}
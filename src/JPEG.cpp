@@ -0,0 +1,1145 @@
+// NOTE: Fast path for baseline JPEGs, which most stock textures are. It only
+// handles 8-bit Huffman-coded sequential images with one (grey) or three
+// (YCbCr) components, where chroma is either full resolution or halved
+// horizontally and/or vertically. Anything else, including progressive files,
+// returns nullptr so the caller can fall back to stb_image.
+//
+// The arithmetic deliberately mirrors stb_image's integer IDCT, upsampling and
+// SSE2 colour conversion, so both decoders produce identical bytes (see
+// testJPEG and benchmarkJPEG).
+
+const int JPEG_FAST_BITS = 9;
+
+// Natural order index of each zigzag coefficient, padded so that corrupt
+// run lengths cannot index past the block.
+const u8 JPEG_DEZIGZAG[64 + 15] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63,
+    63, 63, 63, 63, 63, 63, 63, 63,
+    63, 63, 63, 63, 63, 63, 63
+};
+
+struct JPEGHuffman {
+    u8 fast[1 << JPEG_FAST_BITS];
+    u16 codes[256];
+    u8 values[256];
+    u8 sizes[257];
+    u32 maxCode[18];
+    i32 delta[17];
+};
+
+struct JPEGComponent {
+    u8 id;
+    u8 h;
+    u8 v;
+    u8 quant;
+    u8 dcTable;
+    u8 acTable;
+    i32 dcPrediction;
+    // Size in pixels, and of the MCU-padded plane.
+    u32 x;
+    u32 y;
+    u32 w2;
+    u32 h2;
+    u8* data;
+};
+
+struct JPEGDecoder {
+    u8* ptr;
+    u8* end;
+
+    JPEGHuffman dc[4];
+    JPEGHuffman ac[4];
+    u16 dequant[4][64];
+
+    u32 width;
+    u32 height;
+    u32 componentCount;
+    JPEGComponent components[3];
+    u32 hMax;
+    u32 vMax;
+    u32 mcuX;
+    u32 mcuY;
+    u32 restartInterval;
+    bool frameSeen;
+    bool unsupported;
+
+    u32 bits;
+    i32 bitCount;
+    u8 marker;
+    bool noMore;
+};
+
+const u8 JPEG_NO_MARKER = 0xff;
+
+u16
+readJPEG16(
+    JPEGDecoder& j
+) {
+    if (j.end - j.ptr < 2) {
+        j.ptr = j.end;
+        return 0;
+    }
+    u16 value = (u16)(j.ptr[0] << 8 | j.ptr[1]);
+    j.ptr += 2;
+    return value;
+}
+
+u8
+readJPEG8(
+    JPEGDecoder& j
+) {
+    return j.ptr < j.end ? *j.ptr++ : 0;
+}
+
+bool
+buildJPEGHuffman(
+    JPEGHuffman& h,
+    u8* counts
+) {
+    u32 k = 0;
+    for (u32 i = 0; i < 16; i++) {
+        for (u32 j = 0; j < counts[i]; j++) {
+            if (k >= 256) return false;
+            h.sizes[k++] = (u8)(i + 1);
+        }
+    }
+    h.sizes[k] = 0;
+
+    u32 code = 0;
+    k = 0;
+    for (u32 j = 1; j <= 16; j++) {
+        h.delta[j] = (i32)k - (i32)code;
+        if (h.sizes[k] == j) {
+            while (h.sizes[k] == j) {
+                h.codes[k++] = (u16)code++;
+            }
+            if (code - 1 >= (1u << j)) return false;
+        }
+        h.maxCode[j] = code << (16 - j);
+        code <<= 1;
+    }
+    h.maxCode[17] = 0xffffffff;
+
+    memset(h.fast, 255, sizeof(h.fast));
+    for (u32 i = 0; i < k; i++) {
+        u32 size = h.sizes[i];
+        if (size <= JPEG_FAST_BITS) {
+            u32 c = h.codes[i] << (JPEG_FAST_BITS - size);
+            u32 m = 1 << (JPEG_FAST_BITS - size);
+            for (u32 j = 0; j < m; j++) {
+                h.fast[c + j] = (u8)i;
+            }
+        }
+    }
+    return true;
+}
+
+// Refills the bit buffer to at least 25 bits. Once a marker is hit the data
+// is padded with zeros.
+void
+fillJPEGBits(
+    JPEGDecoder& j
+) {
+    do {
+        u32 b = j.noMore ? 0 : readJPEG8(j);
+        if (b == 0xff) {
+            u32 c = readJPEG8(j);
+            while (c == 0xff) c = readJPEG8(j);
+            if (c != 0) {
+                j.marker = (u8)c;
+                j.noMore = true;
+                return;
+            }
+        }
+        j.bits |= b << (24 - j.bitCount);
+        j.bitCount += 8;
+    } while (j.bitCount <= 24);
+}
+
+i32
+decodeJPEGHuffman(
+    JPEGDecoder& j,
+    JPEGHuffman& h
+) {
+    if (j.bitCount < 16) fillJPEGBits(j);
+
+    u32 c = j.bits >> (32 - JPEG_FAST_BITS);
+    u32 k = h.fast[c];
+    if (k < 255) {
+        i32 size = h.sizes[k];
+        if (size > j.bitCount) return -1;
+        j.bits <<= size;
+        j.bitCount -= size;
+        return h.values[k];
+    }
+
+    u32 top = j.bits >> 16;
+    for (k = JPEG_FAST_BITS + 1; ; k++) {
+        if (top < h.maxCode[k]) break;
+    }
+    if (k == 17 || (i32)k > j.bitCount) {
+        j.bitCount = 0;
+        return -1;
+    }
+    c = (j.bits >> (32 - k)) + h.delta[k];
+    j.bits <<= k;
+    j.bitCount -= k;
+    return h.values[c & 0xff];
+}
+
+// Reads an n-bit magnitude and sign extends it as JPEG coefficients are.
+i32
+receiveJPEGExtend(
+    JPEGDecoder& j,
+    i32 n
+) {
+    if (j.bitCount < n) fillJPEGBits(j);
+    if (j.bitCount < n) return 0;
+    u32 value = j.bits >> (32 - n);
+    j.bits <<= n;
+    j.bitCount -= n;
+    if (value < (1u << (n - 1))) {
+        return (i32)value - (1 << n) + 1;
+    }
+    return (i32)value;
+}
+
+bool
+decodeJPEGBlock(
+    JPEGDecoder& j,
+    JPEGComponent& component,
+    short* block
+) {
+    memset(block, 0, 64 * sizeof(short));
+    u16* dequant = j.dequant[component.quant];
+
+    i32 t = decodeJPEGHuffman(j, j.dc[component.dcTable]);
+    if (t < 0 || t > 15) return false;
+    i32 diff = t ? receiveJPEGExtend(j, t) : 0;
+    i32 dc = component.dcPrediction + diff;
+    component.dcPrediction = dc;
+    block[0] = (short)(dc * dequant[0]);
+
+    auto& ac = j.ac[component.acTable];
+    i32 k = 1;
+    do {
+        i32 rs = decodeJPEGHuffman(j, ac);
+        if (rs < 0) return false;
+        i32 s = rs & 15;
+        i32 r = rs >> 4;
+        if (s == 0) {
+            if (rs != 0xf0) break;
+            k += 16;
+        } else {
+            k += r;
+            u32 zig = JPEG_DEZIGZAG[k++];
+            block[zig] = (short)(receiveJPEGExtend(j, s) * dequant[zig]);
+        }
+    } while (k < 64);
+    return true;
+}
+
+// Fixed point constants of stb_image's integer IDCT.
+#define JPEG_F2F(x) ((int)((x) * 4096 + 0.5))
+
+inline __m128i
+jpegConstPair(
+    int x,
+    int y
+) {
+    return _mm_setr_epi16(
+        (short)x, (short)y, (short)x, (short)y,
+        (short)x, (short)y, (short)x, (short)y
+    );
+}
+
+struct JPEGWide {
+    __m128i lo;
+    __m128i hi;
+};
+
+// Returns x * c0 + y * c1 and x * c2 + y * c3 per lane, widened to 32 bits.
+inline void
+jpegRotate(
+    __m128i x,
+    __m128i y,
+    __m128i c01,
+    __m128i c23,
+    JPEGWide& out0,
+    JPEGWide& out1
+) {
+    __m128i lo = _mm_unpacklo_epi16(x, y);
+    __m128i hi = _mm_unpackhi_epi16(x, y);
+    out0.lo = _mm_madd_epi16(lo, c01);
+    out0.hi = _mm_madd_epi16(hi, c01);
+    out1.lo = _mm_madd_epi16(lo, c23);
+    out1.hi = _mm_madd_epi16(hi, c23);
+}
+
+// x << 12, widened to 32 bits.
+inline JPEGWide
+jpegWiden(
+    __m128i x
+) {
+    JPEGWide out;
+    out.lo = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), x), 4);
+    out.hi = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), x), 4);
+    return out;
+}
+
+inline JPEGWide
+jpegAdd(
+    JPEGWide a,
+    JPEGWide b
+) {
+    return { _mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi) };
+}
+
+inline JPEGWide
+jpegSub(
+    JPEGWide a,
+    JPEGWide b
+) {
+    return { _mm_sub_epi32(a.lo, b.lo), _mm_sub_epi32(a.hi, b.hi) };
+}
+
+// Butterfly of a and b with bias, shifted down and packed back to 16 bits.
+template<int shift>
+inline void
+jpegButterfly(
+    JPEGWide a,
+    JPEGWide b,
+    __m128i bias,
+    __m128i& out0,
+    __m128i& out1
+) {
+    a.lo = _mm_add_epi32(a.lo, bias);
+    a.hi = _mm_add_epi32(a.hi, bias);
+    JPEGWide sum = jpegAdd(a, b);
+    JPEGWide dif = jpegSub(a, b);
+    out0 = _mm_packs_epi32(_mm_srai_epi32(sum.lo, shift), _mm_srai_epi32(sum.hi, shift));
+    out1 = _mm_packs_epi32(_mm_srai_epi32(dif.lo, shift), _mm_srai_epi32(dif.hi, shift));
+}
+
+// One 1D IDCT pass over eight rows at once. Each register holds one row.
+template<int shift>
+inline void
+jpegIDCTPass(
+    __m128i* row,
+    __m128i bias
+) {
+    const __m128i rot0_0 = jpegConstPair(JPEG_F2F(0.5411961f), JPEG_F2F(0.5411961f) + JPEG_F2F(-1.847759065f));
+    const __m128i rot0_1 = jpegConstPair(JPEG_F2F(0.5411961f) + JPEG_F2F(0.765366865f), JPEG_F2F(0.5411961f));
+    const __m128i rot1_0 = jpegConstPair(JPEG_F2F(1.175875602f) + JPEG_F2F(-0.899976223f), JPEG_F2F(1.175875602f));
+    const __m128i rot1_1 = jpegConstPair(JPEG_F2F(1.175875602f), JPEG_F2F(1.175875602f) + JPEG_F2F(-2.562915447f));
+    const __m128i rot2_0 = jpegConstPair(JPEG_F2F(-1.961570560f) + JPEG_F2F(0.298631336f), JPEG_F2F(-1.961570560f));
+    const __m128i rot2_1 = jpegConstPair(JPEG_F2F(-1.961570560f), JPEG_F2F(-1.961570560f) + JPEG_F2F(3.072711026f));
+    const __m128i rot3_0 = jpegConstPair(JPEG_F2F(-0.390180644f) + JPEG_F2F(2.053119869f), JPEG_F2F(-0.390180644f));
+    const __m128i rot3_1 = jpegConstPair(JPEG_F2F(-0.390180644f), JPEG_F2F(-0.390180644f) + JPEG_F2F(1.501321110f));
+
+    // Even part.
+    JPEGWide t2e, t3e;
+    jpegRotate(row[2], row[6], rot0_0, rot0_1, t2e, t3e);
+    JPEGWide t0e = jpegWiden(_mm_add_epi16(row[0], row[4]));
+    JPEGWide t1e = jpegWiden(_mm_sub_epi16(row[0], row[4]));
+    JPEGWide x0 = jpegAdd(t0e, t3e);
+    JPEGWide x3 = jpegSub(t0e, t3e);
+    JPEGWide x1 = jpegAdd(t1e, t2e);
+    JPEGWide x2 = jpegSub(t1e, t2e);
+
+    // Odd part.
+    JPEGWide y0o, y2o, y1o, y3o, y4o, y5o;
+    jpegRotate(row[7], row[3], rot2_0, rot2_1, y0o, y2o);
+    jpegRotate(row[5], row[1], rot3_0, rot3_1, y1o, y3o);
+    __m128i sum17 = _mm_add_epi16(row[1], row[7]);
+    __m128i sum35 = _mm_add_epi16(row[3], row[5]);
+    jpegRotate(sum17, sum35, rot1_0, rot1_1, y4o, y5o);
+    JPEGWide x4 = jpegAdd(y0o, y4o);
+    JPEGWide x5 = jpegAdd(y1o, y5o);
+    JPEGWide x6 = jpegAdd(y2o, y5o);
+    JPEGWide x7 = jpegAdd(y3o, y4o);
+
+    jpegButterfly<shift>(x0, x7, bias, row[0], row[7]);
+    jpegButterfly<shift>(x1, x6, bias, row[1], row[6]);
+    jpegButterfly<shift>(x2, x5, bias, row[2], row[5]);
+    jpegButterfly<shift>(x3, x4, bias, row[3], row[4]);
+}
+
+inline void
+jpegTranspose16(
+    __m128i* row
+) {
+    __m128i a[8], b[8];
+    a[0] = _mm_unpacklo_epi16(row[0], row[4]);
+    a[1] = _mm_unpackhi_epi16(row[0], row[4]);
+    a[2] = _mm_unpacklo_epi16(row[1], row[5]);
+    a[3] = _mm_unpackhi_epi16(row[1], row[5]);
+    a[4] = _mm_unpacklo_epi16(row[2], row[6]);
+    a[5] = _mm_unpackhi_epi16(row[2], row[6]);
+    a[6] = _mm_unpacklo_epi16(row[3], row[7]);
+    a[7] = _mm_unpackhi_epi16(row[3], row[7]);
+
+    b[0] = _mm_unpacklo_epi16(a[0], a[4]);
+    b[1] = _mm_unpackhi_epi16(a[0], a[4]);
+    b[2] = _mm_unpacklo_epi16(a[1], a[5]);
+    b[3] = _mm_unpackhi_epi16(a[1], a[5]);
+    b[4] = _mm_unpacklo_epi16(a[2], a[6]);
+    b[5] = _mm_unpackhi_epi16(a[2], a[6]);
+    b[6] = _mm_unpacklo_epi16(a[3], a[7]);
+    b[7] = _mm_unpackhi_epi16(a[3], a[7]);
+
+    row[0] = _mm_unpacklo_epi16(b[0], b[4]);
+    row[1] = _mm_unpackhi_epi16(b[0], b[4]);
+    row[2] = _mm_unpacklo_epi16(b[1], b[5]);
+    row[3] = _mm_unpackhi_epi16(b[1], b[5]);
+    row[4] = _mm_unpacklo_epi16(b[2], b[6]);
+    row[5] = _mm_unpackhi_epi16(b[2], b[6]);
+    row[6] = _mm_unpacklo_epi16(b[3], b[7]);
+    row[7] = _mm_unpackhi_epi16(b[3], b[7]);
+}
+
+// 8x8 inverse DCT of dequantized coefficients, writing clamped pixels.
+// Columns are transformed first with 2 extra bits of precision, then rows.
+void
+idctJPEGBlock(
+    u8* out,
+    u32 stride,
+    short* block
+) {
+    __m128i row[8];
+    for (int i = 0; i < 8; i++) {
+        row[i] = _mm_loadu_si128((__m128i*)(block + i * 8));
+    }
+
+    jpegIDCTPass<10>(row, _mm_set1_epi32(512));
+    jpegTranspose16(row);
+    jpegIDCTPass<17>(row, _mm_set1_epi32(65536 + (128 << 17)));
+    jpegTranspose16(row);
+
+    for (int i = 0; i < 8; i += 2) {
+        __m128i packed = _mm_packus_epi16(row[i], row[i + 1]);
+        _mm_storel_epi64((__m128i*)(out + i * stride), packed);
+        _mm_storel_epi64((__m128i*)(out + (i + 1) * stride), _mm_srli_si128(packed, 8));
+    }
+}
+
+bool
+decodeJPEGScan(
+    JPEGDecoder& j,
+    u32* order,
+    u32 scanCount
+) {
+    alignas(16) short block[64];
+    j.bits = 0;
+    j.bitCount = 0;
+    j.noMore = false;
+    j.marker = JPEG_NO_MARKER;
+    for (u32 i = 0; i < j.componentCount; i++) {
+        j.components[i].dcPrediction = 0;
+    }
+    i32 todo = j.restartInterval ? (i32)j.restartInterval : 0x7fffffff;
+
+    // Called after each MCU. Returns false once the scan has ended.
+    auto restart = [&]() {
+        if (--todo > 0) return true;
+        if (j.bitCount < 24) fillJPEGBits(j);
+        if (j.marker < 0xd0 || j.marker > 0xd7) return false;
+        j.bits = 0;
+        j.bitCount = 0;
+        j.noMore = false;
+        j.marker = JPEG_NO_MARKER;
+        for (u32 i = 0; i < j.componentCount; i++) {
+            j.components[i].dcPrediction = 0;
+        }
+        todo = j.restartInterval ? (i32)j.restartInterval : 0x7fffffff;
+        return true;
+    };
+
+    if (scanCount == 1) {
+        auto& component = j.components[order[0]];
+        u32 w = (component.x + 7) >> 3;
+        u32 h = (component.y + 7) >> 3;
+        for (u32 y = 0; y < h; y++) {
+            for (u32 x = 0; x < w; x++) {
+                if (!decodeJPEGBlock(j, component, block)) return false;
+                idctJPEGBlock(component.data + component.w2 * y * 8 + x * 8, component.w2, block);
+                if (!restart()) return true;
+            }
+        }
+        return true;
+    }
+
+    for (u32 my = 0; my < j.mcuY; my++) {
+        for (u32 mx = 0; mx < j.mcuX; mx++) {
+            for (u32 k = 0; k < scanCount; k++) {
+                auto& component = j.components[order[k]];
+                for (u32 y = 0; y < component.v; y++) {
+                    for (u32 x = 0; x < component.h; x++) {
+                        u32 x2 = (mx * component.h + x) * 8;
+                        u32 y2 = (my * component.v + y) * 8;
+                        if (!decodeJPEGBlock(j, component, block)) return false;
+                        idctJPEGBlock(component.data + component.w2 * y2 + x2, component.w2, block);
+                    }
+                }
+            }
+            if (!restart()) return true;
+        }
+    }
+    return true;
+}
+
+bool
+readJPEGFrame(
+    JPEGDecoder& j
+) {
+    u16 length = readJPEG16(j);
+    if (readJPEG8(j) != 8) {
+        j.unsupported = true;
+        return false;
+    }
+    j.height = readJPEG16(j);
+    j.width = readJPEG16(j);
+    j.componentCount = readJPEG8(j);
+    if (length != 8 + 3 * j.componentCount ||
+        j.width == 0 || j.height == 0 ||
+        (j.componentCount != 1 && j.componentCount != 3)) {
+        j.unsupported = true;
+        return false;
+    }
+
+    j.hMax = 1;
+    j.vMax = 1;
+    for (u32 i = 0; i < j.componentCount; i++) {
+        auto& component = j.components[i];
+        component.id = readJPEG8(j);
+        u8 sampling = readJPEG8(j);
+        component.h = sampling >> 4;
+        component.v = sampling & 15;
+        component.quant = readJPEG8(j);
+        if (component.h < 1 || component.h > 2 ||
+            component.v < 1 || component.v > 2 ||
+            component.quant > 3) {
+            j.unsupported = true;
+            return false;
+        }
+        if (component.h > j.hMax) j.hMax = component.h;
+        if (component.v > j.vMax) j.vMax = component.v;
+    }
+    if (j.componentCount == 3) {
+        // Luma must be full resolution and both chroma planes alike.
+        auto& y = j.components[0];
+        auto& cb = j.components[1];
+        auto& cr = j.components[2];
+        if (y.h != j.hMax || y.v != j.vMax ||
+            cb.h != cr.h || cb.v != cr.v ||
+            (y.id == 'R' && cb.id == 'G' && cr.id == 'B')) {
+            j.unsupported = true;
+            return false;
+        }
+    }
+
+    j.mcuX = (j.width + j.hMax * 8 - 1) / (j.hMax * 8);
+    j.mcuY = (j.height + j.vMax * 8 - 1) / (j.vMax * 8);
+    for (u32 i = 0; i < j.componentCount; i++) {
+        auto& component = j.components[i];
+        component.x = (j.width * component.h + j.hMax - 1) / j.hMax;
+        component.y = (j.height * component.v + j.vMax - 1) / j.vMax;
+        component.w2 = j.mcuX * component.h * 8;
+        component.h2 = j.mcuY * component.v * 8;
+        component.data = (u8*)calloc(component.w2, component.h2);
+    }
+    j.frameSeen = true;
+    return true;
+}
+
+bool
+readJPEGScanHeader(
+    JPEGDecoder& j,
+    u32* order,
+    u32& scanCount
+) {
+    u16 length = readJPEG16(j);
+    scanCount = readJPEG8(j);
+    if (!j.frameSeen || scanCount < 1 || scanCount > j.componentCount ||
+        length != 6 + 2 * scanCount) {
+        return false;
+    }
+    for (u32 i = 0; i < scanCount; i++) {
+        u8 id = readJPEG8(j);
+        u8 tables = readJPEG8(j);
+        u32 which = 0;
+        while (which < j.componentCount && j.components[which].id != id) which++;
+        if (which == j.componentCount) return false;
+        auto& component = j.components[which];
+        component.dcTable = tables >> 4;
+        component.acTable = tables & 15;
+        if (component.dcTable > 3 || component.acTable > 3) return false;
+        order[i] = which;
+    }
+    u8 spectralStart = readJPEG8(j);
+    u8 spectralEnd = readJPEG8(j);
+    u8 approximation = readJPEG8(j);
+    (void)spectralEnd;
+    return spectralStart == 0 && approximation == 0;
+}
+
+bool
+readJPEGHuffmanTables(
+    JPEGDecoder& j
+) {
+    i32 length = readJPEG16(j) - 2;
+    while (length > 0) {
+        u8 info = readJPEG8(j);
+        u32 type = info >> 4;
+        u32 index = info & 15;
+        if (type > 1 || index > 3) return false;
+        u8 counts[16];
+        u32 total = 0;
+        for (u32 i = 0; i < 16; i++) {
+            counts[i] = readJPEG8(j);
+            total += counts[i];
+        }
+        if (total > 256 || j.end - j.ptr < total) return false;
+        auto& h = type == 0 ? j.dc[index] : j.ac[index];
+        if (!buildJPEGHuffman(h, counts)) return false;
+        memcpy(h.values, j.ptr, total);
+        j.ptr += total;
+        length -= 17 + total;
+    }
+    return length == 0;
+}
+
+bool
+readJPEGQuantTables(
+    JPEGDecoder& j
+) {
+    i32 length = readJPEG16(j) - 2;
+    while (length > 0) {
+        u8 info = readJPEG8(j);
+        bool sixteen = (info >> 4) != 0;
+        u32 index = info & 15;
+        if ((info >> 4) > 1 || index > 3) return false;
+        for (u32 i = 0; i < 64; i++) {
+            j.dequant[index][JPEG_DEZIGZAG[i]] = sixteen ? readJPEG16(j) : readJPEG8(j);
+        }
+        length -= sixteen ? 129 : 65;
+    }
+    return length == 0;
+}
+
+// Upsamplers, one output row at a time. near is the closest input row and far
+// the next closest one.
+u8*
+jpegResampleV2(
+    u8* out,
+    u8* near,
+    u8* far,
+    u32 w
+) {
+    for (u32 i = 0; i < w; i++) {
+        out[i] = (u8)((3 * near[i] + far[i] + 2) >> 2);
+    }
+    return out;
+}
+
+u8*
+jpegResampleH2(
+    u8* out,
+    u8* in,
+    u32 w
+) {
+    if (w == 1) {
+        out[0] = out[1] = in[0];
+        return out;
+    }
+    out[0] = in[0];
+    out[1] = (u8)((in[0] * 3 + in[1] + 2) >> 2);
+    u32 i;
+    for (i = 1; i < w - 1; i++) {
+        u32 n = 3 * in[i] + 2;
+        out[i * 2 + 0] = (u8)((n + in[i - 1]) >> 2);
+        out[i * 2 + 1] = (u8)((n + in[i + 1]) >> 2);
+    }
+    // NOTE: stb_image weights in[w - 2] by 3 here, not the nearer sample.
+    // libjpeg does the opposite, but this decoder has to match stb_image.
+    out[i * 2 + 0] = (u8)((in[w - 2] * 3 + in[w - 1] + 2) >> 2);
+    out[i * 2 + 1] = in[w - 1];
+    return out;
+}
+
+// Both directions at once. The vertical pass is summed into 16-bit columns,
+// then each pair of horizontal outputs is a 3:1 blend of neighbouring columns,
+// eight columns per iteration.
+u8*
+jpegResampleHV2(
+    u8* out,
+    u8* near,
+    u8* far,
+    u32 w,
+    u16* columns
+) {
+    if (w == 1) {
+        out[0] = out[1] = (u8)((3 * near[0] + far[0] + 2) >> 2);
+        return out;
+    }
+
+    u32 i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= w; i += 8) {
+        __m128i n = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(near + i)), zero);
+        __m128i f = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(far + i)), zero);
+        __m128i sum = _mm_add_epi16(_mm_add_epi16(n, _mm_add_epi16(n, n)), f);
+        _mm_storeu_si128((__m128i*)(columns + i), sum);
+    }
+    for (; i < w; i++) {
+        columns[i] = (u16)(3 * near[i] + far[i]);
+    }
+
+    out[0] = (u8)((columns[0] + 2) >> 2);
+    out[1] = (u8)((3 * columns[0] + columns[1] + 8) >> 4);
+    const __m128i bias = _mm_set1_epi16(8);
+    i = 1;
+    for (; i + 9 <= w; i += 8) {
+        __m128i prev = _mm_loadu_si128((__m128i*)(columns + i - 1));
+        __m128i current = _mm_loadu_si128((__m128i*)(columns + i));
+        __m128i next = _mm_loadu_si128((__m128i*)(columns + i + 1));
+        __m128i current3 = _mm_add_epi16(_mm_add_epi16(current, current), current);
+        __m128i left = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(current3, prev), bias), 4);
+        __m128i right = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(current3, next), bias), 4);
+        __m128i even = _mm_unpacklo_epi16(left, right);
+        __m128i odd = _mm_unpackhi_epi16(left, right);
+        _mm_storeu_si128((__m128i*)(out + i * 2), _mm_packus_epi16(even, odd));
+    }
+    // out[i * 2] is the left half of column i, out[i * 2 - 1] the right half
+    // of column i - 1.
+    for (; i < w; i++) {
+        u32 t0 = columns[i - 1];
+        u32 t1 = columns[i];
+        out[i * 2 - 1] = (u8)((3 * t0 + t1 + 8) >> 4);
+        out[i * 2] = (u8)((3 * t1 + t0 + 8) >> 4);
+    }
+    out[w * 2 - 1] = (u8)((columns[w - 1] + 2) >> 2);
+    return out;
+}
+
+// YCbCr to RGBA in 16-bit fixed point, eight pixels per iteration.
+void
+jpegYCbCrToRGBA(
+    u8* out,
+    u8* y,
+    u8* cb,
+    u8* cr,
+    u32 count
+) {
+    u32 i = 0;
+    const __m128i signFlip = _mm_set1_epi8(-0x80);
+    const __m128i crConst0 = _mm_set1_epi16((short)(1.40200f * 4096.0f + 0.5f));
+    const __m128i crConst1 = _mm_set1_epi16(-(short)(0.71414f * 4096.0f + 0.5f));
+    const __m128i cbConst0 = _mm_set1_epi16(-(short)(0.34414f * 4096.0f + 0.5f));
+    const __m128i cbConst1 = _mm_set1_epi16((short)(1.77200f * 4096.0f + 0.5f));
+    const __m128i yBias = _mm_set1_epi8((char)(u8)128);
+    const __m128i alpha = _mm_set1_epi16(255);
+    for (; i + 7 < count; i += 8) {
+        __m128i yBytes = _mm_loadl_epi64((__m128i*)(y + i));
+        __m128i crBytes = _mm_xor_si128(_mm_loadl_epi64((__m128i*)(cr + i)), signFlip);
+        __m128i cbBytes = _mm_xor_si128(_mm_loadl_epi64((__m128i*)(cb + i)), signFlip);
+
+        // Widen to 16 bits, cr and cb shifted left by 8.
+        __m128i yw = _mm_unpacklo_epi8(yBias, yBytes);
+        __m128i crw = _mm_unpacklo_epi8(_mm_setzero_si128(), crBytes);
+        __m128i cbw = _mm_unpacklo_epi8(_mm_setzero_si128(), cbBytes);
+
+        __m128i yws = _mm_srli_epi16(yw, 4);
+        __m128i r = _mm_add_epi16(_mm_mulhi_epi16(crConst0, crw), yws);
+        __m128i g = _mm_add_epi16(
+            _mm_add_epi16(_mm_mulhi_epi16(cbConst0, cbw), yws),
+            _mm_mulhi_epi16(crw, crConst1)
+        );
+        __m128i b = _mm_add_epi16(yws, _mm_mulhi_epi16(cbw, cbConst1));
+        r = _mm_srai_epi16(r, 4);
+        g = _mm_srai_epi16(g, 4);
+        b = _mm_srai_epi16(b, 4);
+
+        // Interleave into RGBA.
+        __m128i rb = _mm_packus_epi16(r, b);
+        __m128i ga = _mm_packus_epi16(g, alpha);
+        __m128i t0 = _mm_unpacklo_epi8(rb, ga);
+        __m128i t1 = _mm_unpackhi_epi8(rb, ga);
+        _mm_storeu_si128((__m128i*)(out + 0), _mm_unpacklo_epi16(t0, t1));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi16(t0, t1));
+        out += 32;
+    }
+
+    #define JPEG_FLOAT2FIXED(x) (((int)((x) * 4096.0f + 0.5f)) << 8)
+    for (; i < count; i++) {
+        i32 yFixed = (y[i] << 20) + (1 << 19);
+        i32 crValue = cr[i] - 128;
+        i32 cbValue = cb[i] - 128;
+        i32 rValue = yFixed + crValue * JPEG_FLOAT2FIXED(1.40200f);
+        i32 gValue = yFixed + (crValue * -JPEG_FLOAT2FIXED(0.71414f)) +
+            ((cbValue * -JPEG_FLOAT2FIXED(0.34414f)) & 0xffff0000);
+        i32 bValue = yFixed + cbValue * JPEG_FLOAT2FIXED(1.77200f);
+        rValue >>= 20;
+        gValue >>= 20;
+        bValue >>= 20;
+        out[0] = (u8)(rValue < 0 ? 0 : rValue > 255 ? 255 : rValue);
+        out[1] = (u8)(gValue < 0 ? 0 : gValue > 255 ? 255 : gValue);
+        out[2] = (u8)(bValue < 0 ? 0 : bValue > 255 ? 255 : bValue);
+        out[3] = 255;
+        out += 4;
+    }
+    #undef JPEG_FLOAT2FIXED
+}
+
+// Upsamples the chroma planes and converts everything to RGBA rows.
+u8*
+outputJPEG(
+    JPEGDecoder& j
+) {
+    u8* rgba = (u8*)malloc((size_t)j.width * j.height * 4);
+
+    if (j.componentCount == 1) {
+        auto& grey = j.components[0];
+        for (u32 y = 0; y < j.height; y++) {
+            u8* in = grey.data + y * grey.w2;
+            u8* out = rgba + (size_t)y * j.width * 4;
+            for (u32 x = 0; x < j.width; x++) {
+                out[0] = out[1] = out[2] = in[x];
+                out[3] = 255;
+                out += 4;
+            }
+        }
+        return rgba;
+    }
+
+    // Chroma resampling state, as in stb_image: line0 and line1 are the two
+    // input rows bracketing the current output row.
+    struct Resample {
+        u8* line0;
+        u8* line1;
+        u32 hs;
+        u32 vs;
+        u32 ystep;
+        u32 ypos;
+        u32 wLores;
+        u8* lineBuffer;
+    } resample[2];
+    u16* columns = (u16*)malloc((j.width + 8) * sizeof(u16));
+    for (u32 k = 0; k < 2; k++) {
+        auto& component = j.components[k + 1];
+        auto& r = resample[k];
+        r.hs = j.hMax / component.h;
+        r.vs = j.vMax / component.v;
+        r.ystep = r.vs >> 1;
+        r.wLores = (j.width + r.hs - 1) / r.hs;
+        r.ypos = 0;
+        r.line0 = r.line1 = component.data;
+        r.lineBuffer = (u8*)malloc(j.width + 3);
+    }
+
+    auto& luma = j.components[0];
+    for (u32 y = 0; y < j.height; y++) {
+        u8* chroma[2];
+        for (u32 k = 0; k < 2; k++) {
+            auto& component = j.components[k + 1];
+            auto& r = resample[k];
+            bool bottom = r.ystep >= (r.vs >> 1);
+            u8* near = bottom ? r.line1 : r.line0;
+            u8* far = bottom ? r.line0 : r.line1;
+            if (r.hs == 1 && r.vs == 1) {
+                chroma[k] = near;
+            } else if (r.hs == 1) {
+                chroma[k] = jpegResampleV2(r.lineBuffer, near, far, r.wLores);
+            } else if (r.vs == 1) {
+                chroma[k] = jpegResampleH2(r.lineBuffer, near, r.wLores);
+            } else {
+                chroma[k] = jpegResampleHV2(r.lineBuffer, near, far, r.wLores, columns);
+            }
+            if (++r.ystep >= r.vs) {
+                r.ystep = 0;
+                r.line0 = r.line1;
+                if (++r.ypos < component.y) {
+                    r.line1 += component.w2;
+                }
+            }
+        }
+        jpegYCbCrToRGBA(
+            rgba + (size_t)y * j.width * 4,
+            luma.data + y * luma.w2,
+            chroma[0],
+            chroma[1],
+            j.width
+        );
+    }
+
+    for (u32 k = 0; k < 2; k++) {
+        free(resample[k].lineBuffer);
+    }
+    free(columns);
+    return rgba;
+}
+
+// Decodes a baseline JPEG to RGBA8. Returns nullptr if the file is not one
+// this decoder handles or is corrupt; the result is freed with free().
+u8*
+decodeJPEG(
+    u8* bytes,
+    u32 size,
+    int& width,
+    int& height
+) {
+    if (size < 4 || bytes[0] != 0xff || bytes[1] != 0xd8) {
+        return nullptr;
+    }
+
+    auto j = (JPEGDecoder*)calloc(1, sizeof(JPEGDecoder));
+    j->ptr = bytes + 2;
+    j->end = bytes + size;
+    j->marker = JPEG_NO_MARKER;
+
+    bool ok = true;
+    bool done = false;
+    while (ok && !done) {
+        // Find the next marker, either left over from the last scan or in
+        // the stream.
+        u8 marker = j->marker;
+        j->marker = JPEG_NO_MARKER;
+        if (marker == JPEG_NO_MARKER) {
+            while (j->ptr < j->end && *j->ptr != 0xff) j->ptr++;
+            while (j->ptr < j->end && *j->ptr == 0xff) j->ptr++;
+            if (j->ptr >= j->end) break;
+            marker = *j->ptr++;
+        }
+
+        switch (marker) {
+            case 0xc0:
+            case 0xc1:
+                ok = !j->frameSeen && readJPEGFrame(*j);
+                break;
+            case 0xc4:
+                ok = readJPEGHuffmanTables(*j);
+                break;
+            case 0xdb:
+                ok = readJPEGQuantTables(*j);
+                break;
+            case 0xdd:
+                readJPEG16(*j);
+                j->restartInterval = readJPEG16(*j);
+                break;
+            case 0xda: {
+                u32 order[3];
+                u32 scanCount;
+                ok = readJPEGScanHeader(*j, order, scanCount) &&
+                    decodeJPEGScan(*j, order, scanCount);
+            } break;
+            case 0xd9:
+                done = true;
+                break;
+            case 0xee:
+                // Adobe APP14 can change the colour transform.
+                j->unsupported = true;
+                ok = false;
+                break;
+            default:
+                if ((marker >= 0xc2 && marker <= 0xcf) || marker == 0xdc) {
+                    // Progressive, lossless, arithmetic coded or DNL.
+                    j->unsupported = true;
+                    ok = false;
+                } else if (marker >= 0xd0 && marker <= 0xd8) {
+                    // Stray restart marker or SOI, no payload.
+                } else {
+                    u16 length = readJPEG16(*j);
+                    if (length < 2 || j->end - j->ptr < length - 2) {
+                        ok = false;
+                    } else {
+                        j->ptr += length - 2;
+                    }
+                }
+                break;
+        }
+    }
+
+    u8* rgba = nullptr;
+    if (ok && j->frameSeen) {
+        rgba = outputJPEG(*j);
+        width = j->width;
+        height = j->height;
+    }
+    for (u32 i = 0; i < j->componentCount; i++) {
+        free(j->components[i].data);
+    }
+    free(j);
+    return rgba;
+}
+
+// Decodes every JPEG in the PAK with stb_image and with decodeJPEG, checks
+// that the output is identical and reports the throughput of both.
+void
+benchmarkJPEG(
+    PAK& pak
+) {
+    char** paths = listFilesInPAK(pak, "", ".jpg");
+    struct File {
+        u8* bytes;
+        u32 size;
+    };
+    File* files = NULL;
+    for (int i = 0; i < arrlen(paths); i++) {
+        auto record = findFileInPAK(pak.bytes, *pak.eocd, paths[i]);
+        File file = {};
+        file.bytes = record ? unpackFile(pak.bytes, record, &file.size) : nullptr;
+        arrput(files, file);
+    }
+
+    u64 pixels = 0;
+    u64 fastPixels = 0;
+    i64 stbTicks = 0;
+    i64 fastTicks = 0;
+    u32 fastCount = 0;
+    u32 fallbackCount = 0;
+    u32 mismatchCount = 0;
+    for (int i = 0; i < arrlen(files); i++) {
+        auto& file = files[i];
+        if (file.bytes == nullptr) continue;
+
+        LARGE_INTEGER start, middle, end;
+        int stbWidth, stbHeight, n;
+        QueryPerformanceCounter(&start);
+        u8* expected = stbi_load_from_memory(file.bytes, file.size, &stbWidth, &stbHeight, &n, 4);
+        QueryPerformanceCounter(&middle);
+        int width, height;
+        u8* actual = decodeJPEG(file.bytes, file.size, width, height);
+        QueryPerformanceCounter(&end);
+        if (expected == nullptr) {
+            ERR("stb_image could not decode '%s' (%s)", paths[i], stbi_failure_reason());
+            free(actual);
+            continue;
+        }
+        pixels += (u64)stbWidth * stbHeight;
+        stbTicks += middle.QuadPart - start.QuadPart;
+
+        if (actual == nullptr) {
+            fallbackCount++;
+        } else {
+            fastCount++;
+            fastPixels += (u64)width * height;
+            fastTicks += end.QuadPart - middle.QuadPart;
+            if (width != stbWidth || height != stbHeight ||
+                memcmp(actual, expected, (size_t)width * height * 4) != 0) {
+                ERR("JPEG decode differs from stb_image: '%s'", paths[i]);
+                mismatchCount++;
+            }
+        }
+        stbi_image_free(expected);
+        free(actual);
+    }
+
+    auto toSeconds = 1.0 / counterFrequency.QuadPart;
+    INFO(
+        "JPEG: %u files, %u on the fast path, %u fell back, %u mismatches",
+        (u32)arrlen(files),
+        fastCount,
+        fallbackCount,
+        mismatchCount
+    );
+    INFO(
+        "JPEG: stb_image %.1f MP/s, fast path %.1f MP/s",
+        stbTicks ? pixels / (stbTicks * toSeconds) / 1e6 : 0.0,
+        fastTicks ? fastPixels / (fastTicks * toSeconds) / 1e6 : 0.0
+    );
+
+    for (int i = 0; i < arrlen(files); i++) {
+        free(files[i].bytes);
+    }
+    arrfree(files);
+    freePAKFileList(paths);
+}
+
+// Decodes every .jpg in directory with decodeJPEG and stb_image and checks
+// that the output is identical. Every fixture must take the fast path, so a
+// decoder that starts falling back cannot pass by comparing nothing. Returns
+// false on any mismatch, fallback or unreadable file.
+bool
+testJPEG(
+    const char* directory
+) {
+    char pattern[MAX_PATH];
+    sprintf_s(pattern, sizeof(pattern), "%s/*.jpg", directory);
+    WIN32_FIND_DATA found;
+    HANDLE find = FindFirstFile(pattern, &found);
+    if (find == INVALID_HANDLE_VALUE) {
+        ERR("no JPEG fixtures in '%s'", directory);
+        return false;
+    }
+
+    u32 fileCount = 0;
+    u32 failureCount = 0;
+    do {
+        char path[MAX_PATH];
+        sprintf_s(path, sizeof(path), "%s/%s", directory, found.cFileName);
+        fileCount++;
+
+        struct _stat stat = {};
+        FILE* file;
+        if (_stat(path, &stat) != 0 || fopen_s(&file, path, "rb") != 0) {
+            ERR("could not open '%s'", path);
+            failureCount++;
+            continue;
+        }
+        u32 size = (u32)stat.st_size;
+        auto bytes = (u8*)malloc(size);
+        bool read = fread(bytes, 1, size, file) == size;
+        fclose(file);
+        if (!read) {
+            ERR("could not read '%s'", path);
+            failureCount++;
+            free(bytes);
+            continue;
+        }
+
+        int stbWidth, stbHeight, n;
+        u8* expected = stbi_load_from_memory(bytes, size, &stbWidth, &stbHeight, &n, 4);
+        int width, height;
+        u8* actual = decodeJPEG(bytes, size, width, height);
+        if (expected == nullptr) {
+            ERR("stb_image could not decode '%s' (%s)", path, stbi_failure_reason());
+            failureCount++;
+        } else if (actual == nullptr) {
+            ERR("JPEG fast path fell back on '%s'", path);
+            failureCount++;
+        } else if (width != stbWidth || height != stbHeight) {
+            ERR("JPEG decode is %dx%d, stb_image %dx%d: '%s'", width, height, stbWidth, stbHeight, path);
+            failureCount++;
+        } else {
+            for (u64 i = 0; i < (u64)width * height * 4; i++) {
+                if (actual[i] != expected[i]) {
+                    ERR(
+                        "JPEG decode differs from stb_image at (%llu, %llu) channel %llu, %u instead of %u: '%s'",
+                        i / 4 % width,
+                        i / 4 / width,
+                        i % 4,
+                        actual[i],
+                        expected[i],
+                        path
+                    );
+                    failureCount++;
+                    break;
+                }
+            }
+        }
+        stbi_image_free(expected);
+        free(actual);
+        free(bytes);
+    } while (FindNextFile(find, &found));
+    FindClose(find);
+
+    INFO("JPEG: %u fixtures, %u failed", fileCount, failureCount);
+    return failureCount == 0;
+}
@@ -5,6 +5,13 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "jcwk/Logging.h"
 #include "jcwk/MathLib.cpp"
 #include "jcwk/Types.h"
@@ -86,6 +93,17 @@ struct BSPFace {
     u32 size[2];
 };
 
+struct BSPLeaf {
+    i32 cluster;
+    i32 area;
+    i32 mins[3];
+    i32 maxs[3];
+    i32 leafFace;
+    i32 leafFaceCount;
+    i32 leafBrush;
+    i32 leafBrushCount;
+};
+
 struct BSPLightMap {
     u8 values[128][128][3];
 };
@@ -170,6 +188,20 @@ struct PushConstants {
 #include "jcwk/Vulkan.cpp"
 #include <vulkan/vulkan_win32.h>
 
+#include "Resources.cpp"
+#include "Workers.cpp"
+#include "Frames.cpp"
+#include "Textures.cpp"
+#include "Options.cpp"
+#include "CRC32.cpp"
+#include "PAK.cpp"
+#include "JPEG.cpp"
+#include "Streaming.cpp"
+#include "Pipeline.cpp"
+#include "Map.cpp"
+#include "Occlusion.cpp"
+#include "CameraPath.cpp"
+
 const float DELTA_MOVE_PER_S = 100.f;
 const float MOUSE_SENSITIVITY = 0.1f;
 const float JOYSTICK_SENSITIVITY = 5;
@@ -197,77 +229,6 @@ WindowProc(
     return DefWindowProc(window, message, wParam, lParam);
 }
 
-CDRecord*
-findFileInPAK(
-    char* pakBytes,
-    EOCD& eocd,
-    const char* path
-) {
-    auto pathLength = strlen(path);
-    u16 index = 0;
-    char* ptr = pakBytes + eocd.cdrOffset;
-    CDRecord* record;
-    while (index < eocd.cdrCount) {
-        record = (CDRecord*)ptr;
-        char* fname = ptr + sizeof(CDRecord);
-        auto maxLen = pathLength <= record->fnameLength
-            ? pathLength
-            : record->fnameLength;
-        if ((record->fnameLength >= pathLength) &&
-            (strncmp(path, fname, maxLen) == 0))
-            return record;
-        ptr += sizeof(CDRecord);
-        ptr += record->fnameLength;
-        ptr += record->extraFieldLength;
-        ptr += record->fileCommentLength;
-        index++;
-    }
-    return nullptr;
-}
-
-u8*
-unpackFile(
-    char* pakBytes,
-    CDRecord* record,
-    u32* uncompressedLength = NULL
-) {
-    auto localHeader = (LocalFileHeader*)(pakBytes + record->localFileHeaderOffset);
-    auto fname = (char*)pakBytes+record->localFileHeaderOffset+sizeof(LocalFileHeader);
-
-    unsigned long compressedLen = localHeader->compressedSize;
-    u8* compressedBytes = (u8*)(pakBytes +
-        record->localFileHeaderOffset +
-        sizeof(LocalFileHeader) +
-        localHeader->fnameLength +
-        localHeader->extraFieldLength);
-    unsigned long uncompressedLen = localHeader->uncompressedSize;
-    auto result = (u8*)malloc(uncompressedLen);
-    
-    if (localHeader->method == 0) {
-        // File is stored, no uncompression needed.
-        *uncompressedLength = uncompressedLen;
-        memcpy(result, compressedBytes, compressedLen);
-        return result;
-    } else if (localHeader->method == 8) {
-        // File is stored with DEFLATE.
-        auto errorCode = puff(
-            result, &uncompressedLen,
-            compressedBytes, &compressedLen
-        );
-        if (errorCode != 0) {
-            ERR("could not unpack '%.*s': %d", record->fnameLength, fname, errorCode);
-        }
-
-        if (uncompressedLength) {
-            *uncompressedLength = uncompressedLen;
-        }
-
-        return result;
-    }
-    ERR("unsupported compression method '%.*s': %d", record->fnameLength, fname, record->method);
-    return nullptr;
-}
-
 int __stdcall
 WinMain(
     HINSTANCE instance,
@@ -277,6 +238,41 @@ WinMain(
 ) {
     initLogging();
 
+    Options options;
+    parseOptions(commandLine, options);
+
+    if (options.testJPEG) {
+        return testJPEG("tests/jpeg") ? 0 : 1;
+    }
+
+    // Load PAK.
+    PAK pak = {};
+    openPAK("pak0.pk3", pak);
+
+    if (options.benchmarkJPEG) {
+        benchmarkJPEG(pak);
+        free(pak.bytes);
+        return 0;
+    }
+    if (options.verifyPAK) {
+        WorkerPool pool;
+        createWorkerPool(options.threads, pool);
+        bool valid = verifyPAK(pak, pool);
+        destroyWorkerPool(pool);
+        free(pak.bytes);
+        return valid ? 0 : 1;
+    }
+    if (options.benchmarkJobs) {
+        benchmarkJobs(options.threads);
+        free(pak.bytes);
+        return 0;
+    }
+    if (options.stressJobs > 0) {
+        stressJobs(options.threads, options.stressJobs);
+        free(pak.bytes);
+        return 0;
+    }
+
     // NOTE: Create window.
     HWND window = NULL;
     {
@@ -293,7 +289,9 @@ WinMain(
             0,
             "MainWindowClass",
             "Kwark Tree",
-            WS_POPUP | WS_VISIBLE,
+            // NOTE: The memory report only needs a surface, not a visible
+            // window.
+            options.memoryReport ? WS_POPUP : WS_POPUP | WS_VISIBLE,
             CW_USEDEFAULT,
             CW_USEDEFAULT,
             800,
@@ -305,16 +303,18 @@ WinMain(
         );
         CHECK(window, "Could not create window");
 
-        SetWindowPos(
-            window,
-            HWND_TOP,
-            0,
-            0,
-            GetSystemMetrics(SM_CXSCREEN),
-            GetSystemMetrics(SM_CYSCREEN),
-            SWP_FRAMECHANGED
-        );
-        ShowCursor(FALSE);
+        if (!options.memoryReport) {
+            SetWindowPos(
+                window,
+                HWND_TOP,
+                0,
+                0,
+                GetSystemMetrics(SM_CXSCREEN),
+                GetSystemMetrics(SM_CYSCREEN),
+                SWP_FRAMECHANGED
+            );
+            ShowCursor(FALSE);
+        }
 
         INFO("Window created");
     }
@@ -346,154 +346,44 @@ WinMain(
     initVK(vk);
     INFO("Vulkan initialized");
 
-    // Load PAK.
-    char* pakBytes;
-    EOCD* eocd;
-    {
-        auto fname = "pak0.pk3";
-
-        struct _stat stat = {};
-        LERROR(_stat(fname, &stat))
-
-        FILE* pakFile;
-        LERROR(fopen_s(&pakFile, fname, "rb"));
-        INFO("File opened");
-
-        // TODO: This malloc is relatively expensive, as is the read following it.
-        // It might be worth checking to see if mmap (or the Windows equivalent)
-        // is faster since the program is reading relatively small chunks of data
-        // in a random pattern instead of sequentially going through the whole
-        // ~400 MB file.
-        pakBytes = (char*)malloc(stat.st_size);
-        INFO("Data allocated");
-
-        auto bytesRead = fread(pakBytes, 1, stat.st_size, pakFile);
-        LERROR(bytesRead != stat.st_size);
-        INFO("PAK file read");
-
-        if (strncmp(pakBytes, "PK", 2)) {
-            FATAL("not a zip file");
-        }
-
-        if (pakBytes[2] != 0x03) {
-            FATAL("wrong zip version: %d", pakBytes[2]);
-        }
-
-        auto c = pakBytes + bytesRead - 1;
-        while ((c[0] != 'P') &&
-            (c[1] != 'K') &&
-            (c[2] != 5) &&
-            (c[3] != 6) &&
-            (c > pakBytes + 4)) {
-            c--;
-        }
-
-        auto offset = c - bytesRead;
-        if (offset == 0) {
-            FATAL("invalid zip, no EOCD");
-        }
-
-        eocd = READ(c, EOCD, 0);
+    // Texture processing.
+    initTextureTables();
+    if (options.textures.compress && !supportsBlockCompression(vk)) {
+        ERR("device does not support BC textures, not compressing");
+        options.textures.compress = false;
     }
-
-    // Load map.
-    u8* bspBytes;
-    {
-        CDRecord* record = findFileInPAK(pakBytes, *eocd, "maps/q3dm17.bsp");
-        bspBytes = unpackFile(pakBytes, record);
-        INFO("BSP file unpacked");
+    if (options.textures.cache) {
+        initTextureCache();
     }
 
-    // Parse BSP.
-    auto& bspHeader = *READ(bspBytes, BSPHeader, 0);
-    if (strncmp(bspHeader.sig, "IBSP", 4) != 0) {
-        FATAL("not a valid IBSP file");
+    // Find maps.
+    char** mapPaths = listFilesInPAK(pak, "maps/", ".bsp");
+    if (arrlen(mapPaths) == 0) {
+        FATAL("no maps in PAK");
     }
-
-    // Parse entitites.
-    BSPEntity* entities = NULL;
+    // A replayed camera path also decides the map.
+    CameraPath cameraPath = {};
+    bool replaying = options.replayPath[0] != '\0';
+    if (replaying && !loadCameraPath(options.replayPath, cameraPath)) {
+        FATAL("could not replay '%s'", options.replayPath);
+    }
+    int mapIndex = 0;
     {
-        enum KEY {
-            CLASS_NAME,
-            ORIGIN,
-            ANGLE,
-            SPAWNFLAGS,
-            UNKNOWN
-        };
-        KEY key = UNKNOWN;
-        enum STATE {
-            OUTSIDE_ENTITY,
-            INSIDE_ENTITY,
-            INSIDE_STRING,
-        };
-        STATE state = OUTSIDE_ENTITY;
-        BSPEntity entity;
-
-        u8* ePos = bspBytes + bspHeader.entities.offset;
-        char buffer[255];
-        memset(buffer, '\0', 255);
-        char* bPos = buffer;
-        while(ePos < bspBytes + bspHeader.entities.offset + bspHeader.entities.length) {
-            char c = *ePos;
-            if (state == OUTSIDE_ENTITY) {
-                if (c == '{') {
-                    state = INSIDE_ENTITY;
-                    entity = {};
-                }
-                ePos++;
-            } else if (state == INSIDE_ENTITY) {
-                if (c == '"') {
-                    bPos = buffer;
-                    state = INSIDE_STRING;
-                } else if (*ePos == '}') {
-                    state = OUTSIDE_ENTITY;
-                    arrput(entities, entity);
-                }
-                ePos++;
-            } else if (state == INSIDE_STRING) {
-                if (*ePos == '"') {
-                    state = INSIDE_ENTITY;
-                    *bPos = '\0';
-                    if (key == CLASS_NAME) {
-                        strncpy_s(entity.className, buffer, 255);
-                    } else if (key == ORIGIN) {
-                        char *s = strstr(buffer, " ");
-                        *s = '\0';
-                        entity.origin.x = (float)atoi(buffer);
-
-                        char *n = s + 1;
-                        s = strstr(n, " ");
-                        *s = '\0';
-                        entity.origin.z = (float)-atoi(n);
-
-                        n = s + 1;
-                        entity.origin.y = (float)-atoi(n);
-                    } else if (key == ANGLE) {
-                        entity.angle = atoi(buffer);
-                    } else if (key == SPAWNFLAGS) {
-                        entity.spawnflags = atoi(buffer);
-                    }
-                    if (strcmp("classname", buffer) == 0) key = CLASS_NAME;
-                    else if (strcmp("origin", buffer) == 0) key = ORIGIN;
-                    else if (strcmp("angle", buffer) == 0) key = ANGLE;
-                    else if (strcmp("spawnflags", buffer) == 0) key = SPAWNFLAGS;
-                    else key = UNKNOWN;
-                } else {
-                    *bPos = c;
-                    bPos++;
-                }
-                ePos++;
+        char path[MAX_PATH];
+        if (replaying) {
+            strncpy_s(path, cameraPath.map, sizeof(path) - 1);
+        } else {
+            sprintf_s(path, "maps/%s.bsp", options.map);
+        }
+        for (int i = 0; i < arrlen(mapPaths); i++) {
+            if (_stricmp(mapPaths[i], path) == 0) {
+                mapIndex = i;
             }
         }
-        INFO("Entities parsed");
     }
 
-    // Parse textures.
-    auto textures = (BSPTexture*)(bspBytes + bspHeader.textures.offset);
-    auto textureCount = bspHeader.textures.length / sizeof(BSPTexture);
-    u32* textureToSampler = NULL;
-    arrsetlen(textureToSampler, textureCount);
-    VulkanSampler* samplers = NULL;
+    // Placeholder textures, shared by all maps.
+    VulkanSampler placeholders[SAMPLER_PLACEHOLDER_COUNT];
 
     // Missing texture.
     {
@@ -507,7 +397,6 @@ WinMain(
             *pixel++ = 0xff;
             *pixel++ = 0xff;
         }
-        auto sampler = arraddnptr(samplers, 1);
         uploadTexture(
             vk.device,
             vk.memories,
@@ -518,7 +407,7 @@ WinMain(
             height,
             data,
             width * height * 4,
-            *sampler
+            placeholders[SAMPLER_MISSING_TEXTURE]
         );
     }
 
@@ -534,7 +423,6 @@ WinMain(
             *pixel++ = 0xff;
             *pixel++ = 0xff;
         }
-        auto sampler = arraddnptr(samplers, 1);
         uploadTexture(
             vk.device,
             vk.memories,
@@ -545,288 +433,115 @@ WinMain(
             height,
             data,
             width * height * 4,
-            *sampler
+            placeholders[SAMPLER_MISSING_FILE]
         );
     }
 
-    // Textures from BSP.
-    for (int i = 0; i < textureCount; i++) {
-        auto& texture = textures[i];
-        auto& sampler = samplers[i];
-        if (strcmp(texture.name, "noshader\0") == 0) {
-            continue;
-        }
-        auto* record = findFileInPAK(pakBytes, *eocd, texture.name);
-        if (record == nullptr) {
-            ERR("could not find file: '%s'", texture.name);
-            textureToSampler[i] = 1;
-            continue;
-        } else {
-            INFO("uploading: '%s'", texture.name);
-        }
-        u32 tgaLen = 0;
-        auto tgaBytes = unpackFile(pakBytes, record, &tgaLen);
-        int x, y, n;
-        u8* data = stbi_load_from_memory(
-            tgaBytes, tgaLen, &x, &y, &n, 4
-        );
-        if (data == nullptr) {
-            ERR("could not load texture: '%s' (%s)", texture.name, stbi_failure_reason());
-            textureToSampler[i] = 0;
-        } else {
-            textureToSampler[i] = arrlenu(samplers);
-            auto sampler = arraddnptr(samplers, 1);
-            uploadTexture(
-                vk.device,
-                vk.memories,
-                vk.queue,
-                vk.queueFamily,
-                vk.cmdPoolTransient,
-                x,
-                y,
-                data,
-                x * y * 4,
-                *sampler
-            );
-            INFO("uploaded '%s'", texture.name);
-        }
-
-        free(data);
-        free(tgaBytes);
-    }
-    INFO("Textures uploaded");
-
-    // Parse lightmaps.
-    u32 lightMapCount = bspHeader.lightMaps.length / sizeof(BSPLightMap);
-    auto lightMaps = (BSPLightMap*)(bspBytes + bspHeader.lightMaps.offset);
-    VulkanSampler* lightMapSamplers = nullptr;
-    arrsetlen(lightMapSamplers, lightMapCount);
-    for (int i = 0; i < lightMapCount; i++) {
-        u8* src = (u8*)(lightMaps + i);
-        u8* end = src + 128 * 128 * 3;
-        u8* data = (u8*)malloc(128 * 128 * 4);
-        u8* dst = data;
-        while (src < end) {
-            *dst++ = *src++;
-            *dst++ = *src++;
-            *dst++ = *src++;
-            *dst++ = 0xff;
+    // Not streamed in yet.
+    {
+        const u8 height = 32;
+        const u8 width = 32;
+        u8 data[width * height * 4];
+        u8* pixel = data;
+        for (int i = 0; i < width * height; i++) {
+            *pixel++ = 0x80;
+            *pixel++ = 0x80;
+            *pixel++ = 0x80;
+            *pixel++ = 0xff;
         }
-
-        auto& sampler = lightMapSamplers[i];
         uploadTexture(
             vk.device,
             vk.memories,
             vk.queue,
             vk.queueFamily,
             vk.cmdPoolTransient,
-            128,
-            128,
+            width,
+            height,
             data,
-            128 * 128 * 4,
-            sampler
+            width * height * 4,
+            placeholders[SAMPLER_STREAMING]
         );
-
-        free(data);
     }
-    INFO("Lightmaps uploaded");
-
-    // Parse vertices.
-    u32 vertexCount = bspHeader.vertices.length / sizeof(BSPVertex);
-    auto vertices = (BSPVertex*)(bspBytes + bspHeader.vertices.offset);
-
-    u32* indices = NULL;
-    u32 indexCount = 0;
-
-    auto meshVertexCount = bspHeader.meshVerts.length / sizeof(u32);
-    auto meshVertices = (u32*)(bspBytes + bspHeader.meshVerts.offset);
-
-    auto faceCount = bspHeader.faces.length / sizeof(BSPFace);
-    auto faces = (BSPFace*)(bspBytes + bspHeader.faces.offset);
-
-    for (int faceIdx = 0; faceIdx < faceCount; faceIdx++) {
-        auto& face = faces[faceIdx];
-        if ((face.type == 1) || (face.type == 3)) {
-            for (int i = 0; i < face.meshVertCount; i++) {
-                auto meshVertIdx = face.meshVert + i;
-                auto meshVert = meshVertices[meshVertIdx];
-                auto idx = face.vertex + meshVert;
-                arrput(indices, idx);
-                indexCount++;
-            }
-        }
+    for (u32 i = 0; i < SAMPLER_PLACEHOLDER_COUNT; i++) {
+        trackDeviceMemory(&sharedMemory, MEMORY_TEXTURES, getImageMemorySize(vk, placeholders[i].image));
     }
-    INFO("BSP file parsed");
 
-    // Record command buffers.
-    VkCommandBuffer* cmds = NULL;
+    // Worker threads for loading, streaming, culling and recording command
+    // buffers.
+    WorkerPool workers;
+    createWorkerPool(options.threads, workers);
+    INFO("%u worker threads", getWorkerCount(workers));
+
+    // Texture streaming.
+    TextureStreamer streamer;
+    createTextureStreamer(pak, workers, options.textures, (u64)options.textureBudgetMB * 1024 * 1024, streamer);
+
+    // Create pipelines.
+    Pipeline defaultPipeline;
+    Pipeline modelPipeline;
     {
-        VulkanMesh mesh = {};
-        uploadMesh(
-            vk.device,
-            vk.memories,
-            vk.queueFamily,
-            vertices,
-            vertexCount*sizeof(BSPVertex),
-            indices,
-            indexCount*sizeof(u32),
-            mesh
-        );
+        const char* cachePath = "pipeline.cache";
+        bool warm = false;
+        auto cache = loadPipelineCache(vk, cachePath, warm);
 
-        VulkanPipeline defaultPipeline;
-        initVKPipeline(
-            vk,
+        LARGE_INTEGER start;
+        QueryPerformanceCounter(&start);
+        const char* names[] = {
             "default",
-            defaultPipeline
-        );
-        VulkanPipeline modelPipeline;
-        initVKPipeline(
-            vk,
-            "model",
-            modelPipeline
-        );
-        VulkanPipeline pipelines[] = {
-            defaultPipeline,
-            modelPipeline
+            "model"
         };
-        auto pipelineCount = sizeof(pipelines) / sizeof(VulkanPipeline);
-
-        for (int i = 0; i < pipelineCount; i++) {
-            auto& pipeline = pipelines[i];
-            updateUniformBuffer(
-                vk.device,
-                pipeline.descriptorSet,
-                0,
-                vk.uniforms.handle
-            );
-            auto samplerCount = arrlenu(samplers);
-            updateCombinedImageSampler(
-                vk.device,
-                pipeline.descriptorSet,
-                1,
-                samplers,
-                samplerCount
-            );
-        }
-        auto lightMapSamplerCount = arrlenu(lightMapSamplers);
-        updateCombinedImageSampler(
-            vk.device,
-            defaultPipeline.descriptorSet,
-            2,
-            lightMapSamplers,
-            lightMapSamplerCount
+        Pipeline pipelines[2] = {};
+        createPipelines(vk, workers, cache, names, pipelines, 2);
+        defaultPipeline = pipelines[0];
+        modelPipeline = pipelines[1];
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&end);
+        INFO(
+            "Pipelines created in %.2f ms (%s cache)",
+            (end.QuadPart - start.QuadPart) * 1000.0 / counterFrequency.QuadPart,
+            warm ? "warm" : "cold"
         );
 
-        u32 framebufferCount = vk.swap.images.size();
-        arrsetlen(cmds, framebufferCount);
-        createCommandBuffers(vk.device, vk.cmdPool, framebufferCount, cmds);
-        for (size_t swapIdx = 0; swapIdx < framebufferCount; swapIdx++) {
-            auto& cmd = cmds[swapIdx];
-            beginFrameCommandBuffer(cmd);
-
-            VkClearValue colorClear;
-            colorClear.color = {};
-            VkClearValue depthClear;
-            depthClear.depthStencil = { 1.f, 0 };
-            VkClearValue clears[] = { colorClear, depthClear };
-
-            VkRenderPassBeginInfo beginInfo = {};
-            beginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-            beginInfo.clearValueCount = 2;
-            beginInfo.pClearValues = clears;
-            beginInfo.framebuffer = vk.swap.framebuffers[swapIdx];
-            beginInfo.renderArea.extent = vk.swap.extent;
-            beginInfo.renderArea.offset = {0, 0};
-            beginInfo.renderPass = vk.renderPass;
-
-            vkCmdBeginRenderPass(cmd, &beginInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-            VkDeviceSize offsets[] = {0};
-            vkCmdBindVertexBuffers(
-                cmd,
-                0, 1,
-                &mesh.vBuff.handle,
-                offsets
-            );
-            vkCmdBindIndexBuffer(
-                cmd,
-                mesh.iBuff.handle,
-                0,
-                VK_INDEX_TYPE_UINT32
-            );
-
-            u32 index = 0;
-            for (u32 faceIdx = 0; faceIdx < faceCount; faceIdx++) {
-                auto& face = faces[faceIdx];
-                PushConstants push;
-                push.texIndex = textureToSampler[face.texture];
-                push.lightIndex = face.lightMap;
-                if (face.type == 3) {
-                    vkCmdBindPipeline(
-                        cmd,
-                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                        modelPipeline.handle
-                    );
-                    vkCmdBindDescriptorSets(
-                        cmd,
-                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                        modelPipeline.layout,
-                        0,
-                        1,
-                        &modelPipeline.descriptorSet,
-                        0,
-                        nullptr
-                    );
-                }
-                if (face.type == 1) {
-                    vkCmdBindPipeline(
-                        cmd,
-                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                        defaultPipeline.handle
-                    );
-                    vkCmdBindDescriptorSets(
-                        cmd,
-                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                        defaultPipeline.layout,
-                        0,
-                        1,
-                        &defaultPipeline.descriptorSet,
-                        0,
-                        nullptr
-                    );
-                }
-                if ((face.type == 1) || (face.type == 3)) {
-                    vkCmdPushConstants(
-                        cmd,
-                        modelPipeline.layout,
-                        VK_SHADER_STAGE_FRAGMENT_BIT,
-                        0,
-                        sizeof(PushConstants),
-                        &push
-                    );
-                    vkCmdDrawIndexed(
-                        cmd,
-                        face.meshVertCount,
-                        1,
-                        index,
-                        0,
-                        0
-                    );
-                    index += face.meshVertCount;
-                }
-            }
+        savePipelineCache(vk, cache, cachePath);
+        vkDestroyPipelineCache(vk.device, cache, nullptr);
+    }
 
-            vkCmdEndRenderPass(cmd);
+    // Frames in flight, with a draw batch per worker thread.
+    FrameRing frames;
+    createFrameRing(vk, options.framesInFlight, sizeof(Uniforms), getWorkerCount(workers), frames);
+
+    // Occlusion culling.
+    Occlusion occlusion;
+    createOcclusion(vk.swap.extent.width, vk.swap.extent.height, options.cull, occlusion);
+    if (options.maxFPS > 0) {
+        // NOTE: Frame capping sleeps, which is only as precise as the system
+        // timer period.
+        timeBeginPeriod(1);
+    }
 
-            VKCHECK(vkEndCommandBuffer(cmd));
+    // Load the first map. This is the same path later maps take, except that
+    // the render thread waits for it and uploads it in one go.
+    Map* map = nullptr;
+    MapLoader loader = {};
+    {
+        startMapLoad(pak, workers, mapPaths[mapIndex], loader);
+        waitForCounter(workers, loader.job);
+        loader.busy = false;
+        if (!loader.succeeded) {
+            FATAL("could not load '%s'", mapPaths[mapIndex]);
         }
+        map = loader.map;
+        loader.map = nullptr;
+        uploadMapStep(vk, defaultPipeline, modelPipeline, placeholders, frames, *map, 0);
+        INFO("Map '%s' loaded", map->data.path);
     }
-    free(pakBytes);
-    free(bspBytes);
-    arrfree(indices);
+    bool recording = options.recordPath[0] != '\0' &&
+        startCameraRecording(options.recordPath, map->data.path, cameraPath);
 
     // Set up state.
     Uniforms uniforms = {};
+    float rotX = 0;
+    float rotY = 0;
     {
         matrixInit(uniforms.proj);
         matrixProjection(
@@ -841,16 +556,10 @@ WinMain(
         quaternionInit(uniforms.rotation);
 
         // Find player spawn.
-        for (int i = 0; i < arrlen(entities); i++) {
-            auto& entity = entities[i];
-            if (strcmp(entity.className, "info_player_deathmatch") == 0) {
-                uniforms.eye.x = entity.origin.x;
-                uniforms.eye.y = entity.origin.y;
-                uniforms.eye.z = entity.origin.z;
-                rotateQuaternionY(-(float)entity.angle, uniforms.rotation);
-                break;
-            }
-        }
+        float angle = 0;
+        findSpawn(map->data, uniforms.eye, angle);
+        rotY = -angle;
+        rotateQuaternionY(rotY, uniforms.rotation);
     }
 
     // Initialize DirectInput.
@@ -858,17 +567,57 @@ WinMain(
     auto mouse = directInput.mouse;
     auto controller = directInput.controller;
 
+    // NOTE: Maps that have been swapped out may still be referenced by frames
+    // the GPU has not finished yet. Once a full ring of frames has been begun
+    // since the swap, every fence covering the old map has been waited on.
+    struct RetiredMap {
+        Map* map;
+        u64 frame;
+    };
+    RetiredMap* retiredMaps = NULL;
+
+    // Uploads for a map that was loaded in the background are spread across
+    // frames so that no single frame stalls for the whole upload.
+    const i64 uploadBudgetTicks = counterFrequency.QuadPart * 2 / 1000;
+    Map* pendingMap = nullptr;
+    i64 worstLoadFrameTicks = 0;
+    bool nextMapKeyWasDown = false;
+
     // Main loop.
     LARGE_INTEGER frameStart = {};
     LARGE_INTEGER frameEnd = {};
-    i64 frameDelta = 0;
+    LARGE_INTEGER lastInputTime = {};
+    QueryPerformanceCounter(&lastInputTime);
     BOOL done = false;
     int errorCode = 0;
-    float rotX = 0;
-    float rotY = 0;
+    if (options.benchmarkRecording) {
+        benchmarkRecording(vk, defaultPipeline, modelPipeline, *map, frames, getWorkerCount(workers));
+        done = true;
+    }
+    if (options.memoryReport) {
+        reportMapMemory(
+            vk,
+            defaultPipeline,
+            modelPipeline,
+            placeholders,
+            frames,
+            workers,
+            streamer,
+            pak,
+            mapPaths,
+            *map
+        );
+        done = true;
+    }
     while (!done) {
         QueryPerformanceCounter(&frameStart);
 
+        // Frame pacing happens before anything else so that the input sampled
+        // below is as fresh as possible when the frame is submitted.
+        paceFrame(vk, frames, options.pacing, options.maxFPS);
+
+        auto& frame = beginFrame(vk, frames);
+
         MSG msg;
         BOOL messageAvailable; 
         do {
@@ -886,45 +635,201 @@ WinMain(
             DispatchMessage(&msg); 
         } while(!done && messageAvailable);
 
-        if (done) {
-            break;
+        // Sample input right before the uniforms are written.
+        LARGE_INTEGER inputTime;
+        QueryPerformanceCounter(&inputTime);
+        if (replaying) {
+            CameraKey key;
+            if (nextCameraKey(cameraPath, key)) {
+                uniforms.eye = key.eye;
+                rotX = key.rotX;
+                rotY = key.rotY;
+                quaternionInit(uniforms.rotation);
+                rotateQuaternionY(rotY, uniforms.rotation);
+                rotateQuaternionX(rotX, uniforms.rotation);
+            } else {
+                // Draw this last frame and stop.
+                done = true;
+            }
+        } else {
+            // Frame rate independent movement stuff.
+            float inputTimeDelta = (inputTime.QuadPart - lastInputTime.QuadPart) /
+                (float)counterFrequency.QuadPart;
+            lastInputTime = inputTime;
+            float moveDelta = DELTA_MOVE_PER_S * inputTimeDelta;
+
+            // Mouse.
+            Vec2i mouseDelta = mouse->getDelta();
+            auto mouseDeltaX = mouseDelta.x * MOUSE_SENSITIVITY;
+            rotY -= mouseDeltaX;
+            auto mouseDeltaY = mouseDelta.y * MOUSE_SENSITIVITY;
+            rotX -= mouseDeltaY;
+            quaternionInit(uniforms.rotation);
+            rotateQuaternionY(rotY, uniforms.rotation);
+            rotateQuaternionX(rotX, uniforms.rotation);
+
+            // Keyboard.
+            if (keyboard['W']) {
+                moveAlongQuaternion(moveDelta, uniforms.rotation, uniforms.eye);
+            }
+            if (keyboard['S']) {
+                moveAlongQuaternion(-moveDelta, uniforms.rotation, uniforms.eye);
+            }
+            if (keyboard['A']) {
+                movePerpendicularToQuaternion(-moveDelta, uniforms.rotation, uniforms.eye);
+            }
+            if (keyboard['D']) {
+                movePerpendicularToQuaternion(moveDelta, uniforms.rotation, uniforms.eye);
+            }
+        }
+        if (recording) {
+            CameraKey key = { uniforms.eye, rotX, rotY };
+            recordCameraKey(cameraPath, key);
         }
 
         // Render frame.
-        updateUniforms(vk, &uniforms, sizeof(uniforms));
-        present(vk, cmds, 1);
+        memcpy(frame.mappedUniforms, &uniforms, sizeof(uniforms));
+        cullMap(occlusion, workers, map->data, uniforms);
+        streamMapTextures(
+            vk,
+            streamer,
+            *map,
+            frames,
+            placeholders[SAMPLER_STREAMING],
+            placeholders[SAMPLER_MISSING_TEXTURE],
+            occlusion.faceVisible
+        );
+        recordFrameCommands(
+            vk,
+            defaultPipeline,
+            modelPipeline,
+            *map,
+            frames,
+            workers,
+            occlusion.faceVisible
+        );
+        submitFrame(vk, frames, frame.cmd);
 
-        // Frame rate independent movement stuff.
-        QueryPerformanceCounter(&frameEnd);
-        float frameTime = (frameEnd.QuadPart - frameStart.QuadPart) /
-            (float)counterFrequency.QuadPart;
-        float moveDelta = DELTA_MOVE_PER_S * frameTime;
+        LARGE_INTEGER presentTime;
+        QueryPerformanceCounter(&presentTime);
+        i64 latencyTicks = presentTime.QuadPart - inputTime.QuadPart;
 
-        // Keyboard.
-        if (keyboard['W']) {
-            moveAlongQuaternion(moveDelta, uniforms.rotation, uniforms.eye);
+        if (done) {
+            break;
         }
-        if (keyboard['S']) {
-            moveAlongQuaternion(-moveDelta, uniforms.rotation, uniforms.eye);
+
+        // Destroy maps the GPU is done with.
+        for (int i = 0; i < arrlen(retiredMaps); i++) {
+            if (frames.count - retiredMaps[i].frame >= frames.depth) {
+                destroyMap(vk, streamer, retiredMaps[i].map);
+                arrdelswap(retiredMaps, i);
+                i--;
+            }
         }
-        if (keyboard['A']) {
-            movePerpendicularToQuaternion(-moveDelta, uniforms.rotation, uniforms.eye);
+
+        // Start loading the next map.
+        bool nextMapKeyDown = keyboard['N'];
+        if (nextMapKeyDown && !nextMapKeyWasDown && !loader.busy && pendingMap == nullptr) {
+            mapIndex = (mapIndex + 1) % arrlen(mapPaths);
+            worstLoadFrameTicks = 0;
+            startMapLoad(pak, workers, mapPaths[mapIndex], loader);
         }
-        if (keyboard['D']) {
-            movePerpendicularToQuaternion(moveDelta, uniforms.rotation, uniforms.eye);
+        nextMapKeyWasDown = nextMapKeyDown;
+
+        // Pick up a finished background load.
+        if (loader.busy && isMapLoadFinished(loader)) {
+            waitForCounter(workers, loader.job);
+            loader.busy = false;
+            if (loader.succeeded) {
+                pendingMap = loader.map;
+            } else {
+                ERR("could not load '%s'", loader.map->data.path);
+                destroyMap(vk, streamer, loader.map);
+            }
+            loader.map = nullptr;
         }
 
-        // Mouse.
-        Vec2i mouseDelta = mouse->getDelta();
-        auto mouseDeltaX = mouseDelta.x * MOUSE_SENSITIVITY;
-        rotY -= mouseDeltaX;
-        auto mouseDeltaY = mouseDelta.y * MOUSE_SENSITIVITY;
-        rotX -= mouseDeltaY;
-        quaternionInit(uniforms.rotation);
-        rotateQuaternionY(rotY, uniforms.rotation);
-        rotateQuaternionX(rotX, uniforms.rotation);
+        // Upload the pending map and swap it in once it is complete.
+        if (pendingMap != nullptr) {
+            bool ready = uploadMapStep(
+                vk,
+                defaultPipeline,
+                modelPipeline,
+                placeholders,
+                frames,
+                *pendingMap,
+                uploadBudgetTicks
+            );
+            if (ready) {
+                RetiredMap retired = { map, frames.count };
+                arrput(retiredMaps, retired);
+                map = pendingMap;
+                pendingMap = nullptr;
+
+                if (recording) {
+                    INFO("Camera recording stopped at map change");
+                    closeCameraPath(cameraPath);
+                    recording = false;
+                }
+
+                float angle = 0;
+                findSpawn(map->data, uniforms.eye, angle);
+                rotX = 0;
+                rotY = -angle;
+
+                LARGE_INTEGER now;
+                QueryPerformanceCounter(&now);
+                INFO(
+                    "Map '%s' swapped in after %.2f ms, worst frame during load %.2f ms",
+                    map->data.path,
+                    (now.QuadPart - loader.startTicks) * 1000.0 / counterFrequency.QuadPart,
+                    worstLoadFrameTicks * 1000.0 / counterFrequency.QuadPart
+                );
+            }
+        }
+
+        QueryPerformanceCounter(&frameEnd);
+        i64 frameTicks = frameEnd.QuadPart - frameStart.QuadPart;
+        if (loader.busy || pendingMap != nullptr) {
+            if (frameTicks > worstLoadFrameTicks) {
+                worstLoadFrameTicks = frameTicks;
+            }
+        }
+        recordFrameStats(frames, frameTicks, latencyTicks, presentTime.QuadPart);
+    }
+
+    if (replaying) {
+        logOcclusionStats("Camera path replay", occlusion.total);
+    }
+    closeCameraPath(cameraPath);
+    destroyOcclusion(occlusion);
+
+    if (loader.busy) {
+        waitForCounter(workers, loader.job);
+        destroyMap(vk, streamer, loader.map);
+    }
+    vkDeviceWaitIdle(vk.device);
+    if (pendingMap != nullptr) {
+        destroyMap(vk, streamer, pendingMap);
+    }
+    for (int i = 0; i < arrlen(retiredMaps); i++) {
+        destroyMap(vk, streamer, retiredMaps[i].map);
+    }
+    arrfree(retiredMaps);
+    destroyMap(vk, streamer, map);
+    destroyTextureStreamer(vk, streamer);
+    destroyPipeline(vk, defaultPipeline);
+    destroyPipeline(vk, modelPipeline);
+    for (u32 i = 0; i < SAMPLER_PLACEHOLDER_COUNT; i++) {
+        destroySampler(vk, placeholders[i], &sharedMemory);
+    }
+    destroyWorkerPool(workers);
+    destroyFrameRing(vk, frames);
+    if (options.maxFPS > 0) {
+        timeEndPeriod(1);
     }
-    arrfree(cmds);
+    freePAKFileList(mapPaths);
+    free(pak.bytes);
 
     return errorCode;
 }
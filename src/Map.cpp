@@ -0,0 +1,1150 @@
+// NOTE: Sampler slots 0 to 2 hold the shared "missing texture", "missing file"
+// and "not streamed in yet" placeholders, map textures start after them.
+const u32 SAMPLER_MISSING_TEXTURE = 0;
+const u32 SAMPLER_MISSING_FILE = 1;
+const u32 SAMPLER_STREAMING = 2;
+const u32 SAMPLER_PLACEHOLDER_COUNT = 3;
+
+// Content and surface flags from the BSP texture lump that matter for picking
+// occluders.
+const u32 CONTENTS_SOLID = 0x1;
+const u32 CONTENTS_TRANSLUCENT = 0x20000000;
+const u32 SURF_SKY = 0x4;
+const u32 SURF_NODRAW = 0x80;
+const u32 SURF_HINT = 0x100;
+const u32 SURF_SKIP = 0x200;
+
+// Faces smaller than this, in square units, hide too little to be worth
+// rasterizing as occluders.
+const float OCCLUDER_MIN_AREA = 32 * 32;
+
+// Per-map memory reports are written here when a map is unloaded.
+const char* MEMORY_REPORT_DIR = "memory";
+
+struct MemoryStage {
+    const char* name;
+    MemorySnapshot snapshot;
+};
+
+// Everything about a map that can be produced without touching the GPU. This
+// is filled in in a background job by loadMapData.
+struct MapData {
+    char path[64];
+    u8* bspBytes;
+    BSPEntity* entities;
+    BSPFace* faces;
+    u32 faceCount;
+    BSPVertex* vertices;
+    u32 vertexCount;
+    u32* indices;
+    // First entry in indices for each face, for faces that are drawn.
+    u32* faceFirstIndex;
+    BSPLeaf* leaves;
+    u32 leafCount;
+    i32* leafFaces;
+    // Faces no leaf refers to, such as those of doors and platforms, can not
+    // be culled by leaf.
+    u8* faceInLeaf;
+    // Occluder triangles in the space the vertex shader works in, three
+    // vertices each, largest faces first.
+    Vec3* occluders;
+    u32* textureToSampler;
+    StreamedTexture* textures;
+    u8* lightMaps;
+    u32 lightMapCount;
+    // What the map holds, and what it held after each load stage.
+    MemoryUsage* memory;
+    MemoryStage* memoryStages;
+};
+
+enum MapUploadStage {
+    UPLOAD_SAMPLERS,
+    UPLOAD_LIGHTMAPS,
+    UPLOAD_MESH,
+    UPLOAD_DESCRIPTORS,
+    UPLOAD_DONE
+};
+
+struct Map {
+    MapData data;
+    MapUploadStage stage;
+    u32 uploadIndex;
+    VulkanSampler* samplers;
+    VulkanSampler* lightMapSamplers;
+    VulkanMesh mesh;
+    VkDescriptorPool descriptorPool;
+    VkDescriptorSet* defaultDescriptorSets;
+    VkDescriptorSet* modelDescriptorSets;
+    // One bit per frame in flight whose descriptor sets do not match samplers.
+    u32 staleDescriptors;
+    // Faces drawn this frame, rebuilt by recordFrameCommands.
+    u32* drawList;
+};
+
+struct MapLoader {
+    // Counts the background job loading the map.
+    JobCounter job;
+    bool busy;
+    bool succeeded;
+    i64 startTicks;
+    Map* map;
+};
+
+void
+recordMemoryStage(
+    MapData& map,
+    const char* name
+) {
+    MemoryStage stage = {};
+    stage.name = name;
+    takeMemorySnapshot(*map.memory, stage.snapshot);
+    arrput(map.memoryStages, stage);
+}
+
+void
+writeMemoryCategories(
+    FILE* file,
+    const char* name,
+    i64* bytes,
+    i64 total
+) {
+    fprintf(file, "\"%s\": {", name);
+    for (u32 i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        fprintf(file, " \"%s\": %lld,", memoryCategoryNames[i], bytes[i]);
+    }
+    fprintf(file, " \"total\": %lld }", total);
+}
+
+void
+writeMemoryUsage(
+    FILE* file,
+    MemorySnapshot& snapshot,
+    i64 heapTotal,
+    i64 deviceTotal
+) {
+    writeMemoryCategories(file, "heap", snapshot.heap, heapTotal);
+    fprintf(file, ", ");
+    writeMemoryCategories(file, "device", snapshot.device, deviceTotal);
+}
+
+// Writes the map's stages and peaks, next to what is shared between maps, as
+// JSON to MEMORY_REPORT_DIR/<map>.json. All sizes are in bytes.
+void
+writeMemoryReport(
+    MapData& map,
+    u32 samplerCount,
+    u32 descriptorSetCount
+) {
+    if (!CreateDirectory(MEMORY_REPORT_DIR, NULL) &&
+        GetLastError() != ERROR_ALREADY_EXISTS) {
+        ERR("could not create memory report directory '%s'", MEMORY_REPORT_DIR);
+        return;
+    }
+    const char* name = strrchr(map.path, '/');
+    name = name ? name + 1 : map.path;
+    char path[MAX_PATH];
+    sprintf_s(path, "%s/%.*s.json", MEMORY_REPORT_DIR, (int)strcspn(name, "."), name);
+    FILE* file;
+    if (fopen_s(&file, path, "w") != 0) {
+        ERR("could not write memory report '%s'", path);
+        return;
+    }
+
+    u32 resident = 0;
+    for (int i = 0; i < arrlen(map.textures); i++) {
+        resident += map.textures[i].residency == TEXTURE_RESIDENT;
+    }
+    fprintf(file, "{\n  \"map\": \"%s\",\n", map.path);
+    fprintf(file, "  \"textures\": %u,\n", (u32)arrlenu(map.textures));
+    fprintf(file, "  \"residentTextures\": %u,\n", resident);
+    fprintf(file, "  \"samplers\": %u,\n", samplerCount);
+    fprintf(file, "  \"descriptorSets\": %u,\n", descriptorSetCount);
+    fprintf(file, "  \"stages\": [\n");
+    for (int i = 0; i < arrlen(map.memoryStages); i++) {
+        auto& stage = map.memoryStages[i];
+        i64 heapTotal = 0;
+        i64 deviceTotal = 0;
+        for (u32 c = 0; c < MEMORY_CATEGORY_COUNT; c++) {
+            heapTotal += stage.snapshot.heap[c];
+            deviceTotal += stage.snapshot.device[c];
+        }
+        fprintf(file, "    { \"name\": \"%s\", ", stage.name);
+        writeMemoryUsage(file, stage.snapshot, heapTotal, deviceTotal);
+        fprintf(file, " }%s\n", i + 1 < arrlen(map.memoryStages) ? "," : "");
+    }
+    fprintf(file, "  ],\n");
+
+    MemorySnapshot peak;
+    for (u32 c = 0; c < MEMORY_CATEGORY_COUNT; c++) {
+        peak.heap[c] = map.memory->heapPeak[c].load();
+        peak.device[c] = map.memory->devicePeak[c].load();
+    }
+    fprintf(file, "  \"peak\": { ");
+    writeMemoryUsage(file, peak, map.memory->heapTotalPeak.load(), map.memory->deviceTotalPeak.load());
+    fprintf(file, " },\n");
+
+    MemorySnapshot shared;
+    takeMemorySnapshot(sharedMemory, shared);
+    fprintf(file, "  \"shared\": { ");
+    writeMemoryUsage(file, shared, sharedMemory.heapTotal.load(), sharedMemory.deviceTotal.load());
+    fprintf(file, " },\n");
+    fprintf(file, "  \"pipelineCreationHeapPeak\": %lld\n}\n", pipelineHeapPeak.load());
+    fclose(file);
+
+    double toMB = 1.0 / (1024 * 1024);
+    INFO(
+        "Memory for '%s': %.1f MB heap, %.1f MB device at peak, report in '%s'",
+        map.path,
+        map.memory->heapTotalPeak.load() * toMB,
+        map.memory->deviceTotalPeak.load() * toMB,
+        path
+    );
+}
+
+void
+parseEntities(
+    u8* bspBytes,
+    BSPHeader& bspHeader,
+    BSPEntity*& entities
+) {
+    enum KEY {
+        CLASS_NAME,
+        ORIGIN,
+        ANGLE,
+        SPAWNFLAGS,
+        UNKNOWN
+    };
+    KEY key = UNKNOWN;
+    enum STATE {
+        OUTSIDE_ENTITY,
+        INSIDE_ENTITY,
+        INSIDE_STRING,
+    };
+    STATE state = OUTSIDE_ENTITY;
+    BSPEntity entity;
+
+    u8* ePos = bspBytes + bspHeader.entities.offset;
+    char buffer[255];
+    memset(buffer, '\0', 255);
+    char* bPos = buffer;
+    while(ePos < bspBytes + bspHeader.entities.offset + bspHeader.entities.length) {
+        char c = *ePos;
+        if (state == OUTSIDE_ENTITY) {
+            if (c == '{') {
+                state = INSIDE_ENTITY;
+                entity = {};
+            }
+            ePos++;
+        } else if (state == INSIDE_ENTITY) {
+            if (c == '"') {
+                bPos = buffer;
+                state = INSIDE_STRING;
+            } else if (*ePos == '}') {
+                state = OUTSIDE_ENTITY;
+                arrput(entities, entity);
+            }
+            ePos++;
+        } else if (state == INSIDE_STRING) {
+            if (*ePos == '"') {
+                state = INSIDE_ENTITY;
+                *bPos = '\0';
+                if (key == CLASS_NAME) {
+                    strncpy_s(entity.className, buffer, 255);
+                } else if (key == ORIGIN) {
+                    char *s = strstr(buffer, " ");
+                    *s = '\0';
+                    entity.origin.x = (float)atoi(buffer);
+
+                    char *n = s + 1;
+                    s = strstr(n, " ");
+                    *s = '\0';
+                    entity.origin.z = (float)-atoi(n);
+
+                    n = s + 1;
+                    entity.origin.y = (float)-atoi(n);
+                } else if (key == ANGLE) {
+                    entity.angle = atoi(buffer);
+                } else if (key == SPAWNFLAGS) {
+                    entity.spawnflags = atoi(buffer);
+                }
+                if (strcmp("classname", buffer) == 0) key = CLASS_NAME;
+                else if (strcmp("origin", buffer) == 0) key = ORIGIN;
+                else if (strcmp("angle", buffer) == 0) key = ANGLE;
+                else if (strcmp("spawnflags", buffer) == 0) key = SPAWNFLAGS;
+                else key = UNKNOWN;
+            } else {
+                *bPos = c;
+                bPos++;
+            }
+            ePos++;
+        }
+    }
+}
+
+// Unpacks and parses everything the map needs from the PAK. Safe to call from
+// any thread of pool: it only reads from the PAK and touches no Vulkan state.
+bool
+loadMapData(
+    PAK& pak,
+    WorkerPool& pool,
+    const char* path,
+    MapData& map
+) {
+    strncpy_s(map.path, path, sizeof(map.path) - 1);
+
+    // Load map.
+    {
+        CDRecord* record = findFileInPAK(pak.bytes, *pak.eocd, path);
+        if (record == nullptr) {
+            ERR("could not find map '%s'", path);
+            return false;
+        }
+        u32 bspLength = 0;
+        map.bspBytes = unpackFile(pak.bytes, record, &bspLength);
+        if (map.bspBytes == nullptr) {
+            return false;
+        }
+        trackHeapMemory(map.memory, MEMORY_GEOMETRY, bspLength);
+        recordMemoryStage(map, "unpacked");
+        INFO("BSP file unpacked");
+    }
+    u8* bspBytes = map.bspBytes;
+
+    // Parse BSP.
+    auto& bspHeader = *READ(bspBytes, BSPHeader, 0);
+    if (strncmp(bspHeader.sig, "IBSP", 4) != 0) {
+        ERR("not a valid IBSP file: '%s'", path);
+        return false;
+    }
+
+    // Parse entitites.
+    parseEntities(bspBytes, bspHeader, map.entities);
+    trackHeapMemory(map.memory, MEMORY_GEOMETRY, arrlenu(map.entities) * sizeof(BSPEntity));
+    INFO("Entities parsed");
+
+    // Find texture files in the PAK. They are only decoded once something
+    // using them is seen, see Streaming.cpp.
+    auto textures = (BSPTexture*)(bspBytes + bspHeader.textures.offset);
+    u32 textureCount = bspHeader.textures.length / sizeof(BSPTexture);
+    arrsetlen(map.textureToSampler, textureCount);
+    bool* opaqueTextures = NULL;
+    arrsetlen(opaqueTextures, textureCount);
+    CDRecord** records = NULL;
+    arrsetlen(records, textureCount);
+    parallelFor(pool, textureCount, [&](u32 i) {
+        records[i] = strcmp(textures[i].name, "noshader\0") == 0
+            ? nullptr
+            : findFileInPAK(pak.bytes, *pak.eocd, textures[i].name);
+    });
+    for (u32 i = 0; i < textureCount; i++) {
+        auto& texture = textures[i];
+        map.textureToSampler[i] = SAMPLER_MISSING_TEXTURE;
+        opaqueTextures[i] = false;
+        if (strcmp(texture.name, "noshader\0") == 0) {
+            continue;
+        }
+        auto record = records[i];
+        if (record == nullptr) {
+            ERR("could not find file: '%s'", texture.name);
+            map.textureToSampler[i] = SAMPLER_MISSING_FILE;
+            continue;
+        }
+        StreamedTexture streamed = {};
+        streamed.name = texture.name;
+        streamed.record = record;
+        streamed.slot = SAMPLER_PLACEHOLDER_COUNT + (u32)arrlenu(map.textures);
+        streamed.memory = map.memory;
+        map.textureToSampler[i] = streamed.slot;
+        arrput(map.textures, streamed);
+
+        // NOTE: Whether a texture has alpha is not known until it is decoded,
+        // but JPEGs never do.
+        char* fname = (char*)record + sizeof(CDRecord);
+        opaqueTextures[i] = record->fnameLength > 4 &&
+            _strnicmp(fname + record->fnameLength - 4, ".jpg", 4) == 0;
+    }
+    arrfree(records);
+    trackHeapMemory(
+        map.memory,
+        MEMORY_TEXTURES,
+        arrlenu(map.textures) * sizeof(StreamedTexture) + textureCount * sizeof(u32)
+    );
+    INFO("%u textures found", (u32)arrlenu(map.textures));
+
+    // Convert lightmaps to RGBA, alongside parsing the geometry.
+    map.lightMapCount = bspHeader.lightMaps.length / sizeof(BSPLightMap);
+    auto lightMaps = (BSPLightMap*)(bspBytes + bspHeader.lightMaps.offset);
+    map.lightMaps = (u8*)malloc(map.lightMapCount * 128 * 128 * 4);
+    trackHeapMemory(map.memory, MEMORY_LIGHTMAPS, map.lightMapCount * 128 * 128 * 4);
+    JobCounter lightMapsConverted;
+    runJob(pool, [&]() {
+        parallelFor(pool, map.lightMapCount, [&](u32 lightMapIdx) {
+            u8* src = (u8*)&lightMaps[lightMapIdx];
+            u8* end = src + 128 * 128 * 3;
+            u8* dst = map.lightMaps + lightMapIdx * 128 * 128 * 4;
+            while (src < end) {
+                *dst++ = *src++;
+                *dst++ = *src++;
+                *dst++ = *src++;
+                *dst++ = 0xff;
+            }
+        });
+    }, &lightMapsConverted);
+
+    // Parse vertices.
+    map.vertexCount = bspHeader.vertices.length / sizeof(BSPVertex);
+    map.vertices = (BSPVertex*)(bspBytes + bspHeader.vertices.offset);
+
+    auto meshVertices = (u32*)(bspBytes + bspHeader.meshVerts.offset);
+
+    map.faceCount = bspHeader.faces.length / sizeof(BSPFace);
+    map.faces = (BSPFace*)(bspBytes + bspHeader.faces.offset);
+
+    // Lay out the index buffer first so that faces can fill in their part in
+    // parallel.
+    arrsetlen(map.faceFirstIndex, map.faceCount);
+    u32 indexCount = 0;
+    for (u32 faceIdx = 0; faceIdx < map.faceCount; faceIdx++) {
+        auto& face = map.faces[faceIdx];
+        map.faceFirstIndex[faceIdx] = indexCount;
+        if ((face.type == 1) || (face.type == 3)) {
+            indexCount += face.meshVertCount;
+        }
+    }
+    arrsetlen(map.indices, indexCount);
+    parallelFor(pool, map.faceCount, [&](u32 faceIdx) {
+        auto& face = map.faces[faceIdx];
+        if ((face.type == 1) || (face.type == 3)) {
+            u32* dst = map.indices + map.faceFirstIndex[faceIdx];
+            for (u32 i = 0; i < face.meshVertCount; i++) {
+                auto meshVertIdx = face.meshVert + i;
+                auto meshVert = meshVertices[meshVertIdx];
+                dst[i] = face.vertex + meshVert;
+            }
+        }
+    });
+    INFO("BSP file parsed");
+
+    // Leaves, for occlusion tests.
+    map.leafCount = bspHeader.leafs.length / sizeof(BSPLeaf);
+    map.leaves = (BSPLeaf*)(bspBytes + bspHeader.leafs.offset);
+    map.leafFaces = (i32*)(bspBytes + bspHeader.leafFaces.offset);
+    arrsetlen(map.faceInLeaf, map.faceCount);
+    memset(map.faceInLeaf, 0, map.faceCount);
+    for (u32 leafIdx = 0; leafIdx < map.leafCount; leafIdx++) {
+        auto& leaf = map.leaves[leafIdx];
+        for (i32 i = 0; i < leaf.leafFaceCount; i++) {
+            map.faceInLeaf[map.leafFaces[leaf.leafFace + i]] = 1;
+        }
+    }
+
+    // Pick occluders: large, solid, opaque polygons.
+    {
+        struct Occluder {
+            u32 face;
+            float area;
+        };
+        float* areas = NULL;
+        arrsetlen(areas, map.faceCount);
+        parallelFor(pool, map.faceCount, [&](u32 faceIdx) {
+            auto& face = map.faces[faceIdx];
+            areas[faceIdx] = 0;
+            if (face.type != 1) return;
+            auto& texture = textures[face.texture];
+            if (!(texture.contents & CONTENTS_SOLID)) return;
+            if (texture.contents & CONTENTS_TRANSLUCENT) return;
+            if (texture.flags & (SURF_SKY | SURF_NODRAW | SURF_HINT | SURF_SKIP)) return;
+            if (!opaqueTextures[face.texture]) return;
+
+            float area = 0;
+            auto first = map.faceFirstIndex[faceIdx];
+            for (u32 i = 0; i + 2 < face.meshVertCount; i += 3) {
+                auto a = map.vertices[map.indices[first + i]].position;
+                auto b = map.vertices[map.indices[first + i + 1]].position;
+                auto c = map.vertices[map.indices[first + i + 2]].position;
+                Vec3 ab = { b.x - a.x, b.y - a.y, b.z - a.z };
+                Vec3 ac = { c.x - a.x, c.y - a.y, c.z - a.z };
+                Vec3 n = {
+                    ab.y * ac.z - ab.z * ac.y,
+                    ab.z * ac.x - ab.x * ac.z,
+                    ab.x * ac.y - ab.y * ac.x
+                };
+                area += 0.5f * sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+            }
+            areas[faceIdx] = area;
+        });
+        Occluder* candidates = NULL;
+        for (u32 faceIdx = 0; faceIdx < map.faceCount; faceIdx++) {
+            if (areas[faceIdx] < OCCLUDER_MIN_AREA) continue;
+            arrput(candidates, (Occluder{ faceIdx, areas[faceIdx] }));
+        }
+        arrfree(areas);
+        qsort(
+            candidates,
+            arrlenu(candidates),
+            sizeof(Occluder),
+            [](const void* a, const void* b) {
+                float areaA = ((Occluder*)a)->area;
+                float areaB = ((Occluder*)b)->area;
+                return (areaA < areaB) - (areaA > areaB);
+            }
+        );
+        for (int c = 0; c < arrlen(candidates); c++) {
+            auto& face = map.faces[candidates[c].face];
+            auto first = map.faceFirstIndex[candidates[c].face];
+            for (u32 i = 0; i + 2 < face.meshVertCount; i += 3) {
+                for (u32 j = 0; j < 3; j++) {
+                    auto p = map.vertices[map.indices[first + i + j]].position;
+                    arrput(map.occluders, (Vec3{ p.x, -p.z, p.y }));
+                }
+            }
+        }
+        INFO(
+            "%u occluder faces, %u triangles",
+            (u32)arrlenu(candidates),
+            (u32)arrlenu(map.occluders) / 3
+        );
+        arrfree(candidates);
+    }
+    arrfree(opaqueTextures);
+
+    waitForCounter(pool, lightMapsConverted);
+    INFO("Lightmaps converted");
+
+    trackHeapMemory(
+        map.memory,
+        MEMORY_GEOMETRY,
+        arrlenu(map.indices) * sizeof(u32) +
+            arrlenu(map.faceFirstIndex) * sizeof(u32) +
+            arrlenu(map.faceInLeaf) +
+            arrlenu(map.occluders) * sizeof(Vec3)
+    );
+    recordMemoryStage(map, "parsed");
+
+    return true;
+}
+
+void
+freeMapData(
+    MapData& map
+) {
+    for (int i = 0; i < arrlen(map.textures); i++) {
+        free(map.textures[i].decoded.data);
+    }
+    arrfree(map.textures);
+    arrfree(map.entities);
+    arrfree(map.indices);
+    arrfree(map.faceFirstIndex);
+    arrfree(map.faceInLeaf);
+    arrfree(map.occluders);
+    arrfree(map.textureToSampler);
+    free(map.lightMaps);
+    free(map.bspBytes);
+    arrfree(map.memoryStages);
+    delete map.memory;
+    map = {};
+}
+
+void
+startMapLoad(
+    PAK& pak,
+    WorkerPool& pool,
+    const char* path,
+    MapLoader& loader
+) {
+    loader.map = (Map*)calloc(1, sizeof(Map));
+    strncpy_s(loader.map->data.path, path, sizeof(loader.map->data.path) - 1);
+    loader.map->data.memory = new MemoryUsage();
+    loader.busy = true;
+    loader.succeeded = false;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    loader.startTicks = now.QuadPart;
+    runBackgroundJob(pool, [&pak, &pool, &loader]() {
+        char path[64];
+        strncpy_s(path, loader.map->data.path, sizeof(path) - 1);
+        loader.succeeded = loadMapData(pak, pool, path, loader.map->data);
+    }, &loader.job);
+    INFO("Loading '%s' in the background", path);
+}
+
+// Returns whether the background load has finished, without waiting for it.
+bool
+isMapLoadFinished(
+    MapLoader& loader
+) {
+    return loader.job.pending.load(std::memory_order_acquire) == 0;
+}
+
+// Faces are split into batches of at least this many draws; smaller batches
+// cost more in command buffer overhead than recording them in parallel saves.
+const u32 MIN_DRAWS_PER_BATCH = 64;
+
+// Records draws for faces into a secondary command buffer that continues the
+// frame's render pass. Pipelines are only rebound when the face type changes.
+void
+recordDrawBatch(
+    Vulkan& vk,
+    Pipeline& defaultPipeline,
+    Pipeline& modelPipeline,
+    Map& map,
+    u32 frameIdx,
+    VkFramebuffer framebuffer,
+    u32* faceIndices,
+    u32 count,
+    VkCommandBuffer cmd
+) {
+    VkCommandBufferInheritanceInfo inheritanceInfo = {};
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritanceInfo.renderPass = vk.renderPass;
+    inheritanceInfo.subpass = 0;
+    inheritanceInfo.framebuffer = framebuffer;
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+        VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+    VKCHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+
+    VkDeviceSize offsets[] = {0};
+    vkCmdBindVertexBuffers(
+        cmd,
+        0, 1,
+        &map.mesh.vBuff.handle,
+        offsets
+    );
+    vkCmdBindIndexBuffer(
+        cmd,
+        map.mesh.iBuff.handle,
+        0,
+        VK_INDEX_TYPE_UINT32
+    );
+
+    u32 boundType = 0;
+    for (u32 i = 0; i < count; i++) {
+        u32 faceIdx = faceIndices[i];
+        auto& face = map.data.faces[faceIdx];
+
+        if (face.type != boundType) {
+            auto& pipeline = face.type == 3 ? modelPipeline : defaultPipeline;
+            auto descriptorSets = face.type == 3
+                ? map.modelDescriptorSets
+                : map.defaultDescriptorSets;
+            vkCmdBindPipeline(
+                cmd,
+                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                pipeline.handle
+            );
+            vkCmdBindDescriptorSets(
+                cmd,
+                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                pipeline.layout,
+                0,
+                1,
+                &descriptorSets[frameIdx],
+                0,
+                nullptr
+            );
+            boundType = face.type;
+        }
+
+        PushConstants push;
+        push.texIndex = map.data.textureToSampler[face.texture];
+        push.lightIndex = face.lightMap;
+        vkCmdPushConstants(
+            cmd,
+            modelPipeline.layout,
+            VK_SHADER_STAGE_FRAGMENT_BIT,
+            0,
+            sizeof(PushConstants),
+            &push
+        );
+        vkCmdDrawIndexed(
+            cmd,
+            face.meshVertCount,
+            1,
+            map.data.faceFirstIndex[faceIdx],
+            0,
+            0
+        );
+    }
+
+    VKCHECK(vkEndCommandBuffer(cmd));
+}
+
+// Records the current frame's command buffer, drawing only faces whose entry
+// in faceVisible is set. The visible faces are cut into contiguous batches
+// that are recorded in parallel on the pool, at most one batch per thread,
+// and executed in order from the primary command buffer.
+void
+recordFrameCommands(
+    Vulkan& vk,
+    Pipeline& defaultPipeline,
+    Pipeline& modelPipeline,
+    Map& map,
+    FrameRing& frames,
+    WorkerPool& pool,
+    u8* faceVisible
+) {
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    auto& frame = frames.frames[frames.index];
+    auto framebuffer = vk.swap.framebuffers[frames.imageIndex];
+
+    arrsetlen(map.drawList, 0);
+    for (u32 faceIdx = 0; faceIdx < map.data.faceCount; faceIdx++) {
+        auto type = map.data.faces[faceIdx].type;
+        if ((type == 1 || type == 3) && faceVisible[faceIdx]) {
+            arrput(map.drawList, faceIdx);
+        }
+    }
+    u32 drawCount = (u32)arrlenu(map.drawList);
+    u32 batchCount = (drawCount + MIN_DRAWS_PER_BATCH - 1) / MIN_DRAWS_PER_BATCH;
+    if (batchCount > getWorkerCount(pool)) batchCount = getWorkerCount(pool);
+    if (batchCount > frames.batchCount) batchCount = frames.batchCount;
+
+    parallelFor(pool, batchCount, [&](u32 batch) {
+        u32 first = (u32)((u64)drawCount * batch / batchCount);
+        u32 end = (u32)((u64)drawCount * (batch + 1) / batchCount);
+        recordDrawBatch(
+            vk,
+            defaultPipeline,
+            modelPipeline,
+            map,
+            frames.index,
+            framebuffer,
+            map.drawList + first,
+            end - first,
+            frame.batchCmds[batch]
+        );
+    });
+
+    auto cmd = frame.cmd;
+    beginFrameCommandBuffer(cmd);
+
+    VkClearValue colorClear;
+    colorClear.color = {};
+    VkClearValue depthClear;
+    depthClear.depthStencil = { 1.f, 0 };
+    VkClearValue clears[] = { colorClear, depthClear };
+
+    VkRenderPassBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    beginInfo.clearValueCount = 2;
+    beginInfo.pClearValues = clears;
+    beginInfo.framebuffer = framebuffer;
+    beginInfo.renderArea.extent = vk.swap.extent;
+    beginInfo.renderArea.offset = {0, 0};
+    beginInfo.renderPass = vk.renderPass;
+
+    vkCmdBeginRenderPass(cmd, &beginInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+    if (batchCount > 0) {
+        vkCmdExecuteCommands(cmd, batchCount, frame.batchCmds);
+    }
+    vkCmdEndRenderPass(cmd);
+
+    VKCHECK(vkEndCommandBuffer(cmd));
+
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+    auto ticks = end.QuadPart - start.QuadPart;
+    frames.stats.recordTicks += ticks;
+    if (ticks > frames.stats.maxRecordTicks) {
+        frames.stats.maxRecordTicks = ticks;
+    }
+}
+
+// Records every face of the map over and over with pools of 1, 2, 4, ...
+// threads up to maxThreads, and logs how long a frame takes to record with
+// each. Nothing is submitted; the device must be idle.
+void
+benchmarkRecording(
+    Vulkan& vk,
+    Pipeline& defaultPipeline,
+    Pipeline& modelPipeline,
+    Map& map,
+    FrameRing& frames,
+    u32 maxThreads
+) {
+    const u32 iterations = 100;
+    u8* faceVisible = (u8*)malloc(map.data.faceCount);
+    memset(faceVisible, 1, map.data.faceCount);
+    auto& frame = frames.frames[frames.index];
+
+    double baseMS = 0;
+    for (u32 threads = 1; ; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+        WorkerPool pool;
+        createWorkerPool(threads, pool);
+        i64 ticks = 0;
+        for (u32 i = 0; i < iterations; i++) {
+            VKCHECK(vkResetCommandPool(vk.device, frame.cmdPool, 0));
+            for (u32 b = 0; b < frames.batchCount; b++) {
+                VKCHECK(vkResetCommandPool(vk.device, frame.batchPools[b], 0));
+            }
+            LARGE_INTEGER start, end;
+            QueryPerformanceCounter(&start);
+            recordFrameCommands(vk, defaultPipeline, modelPipeline, map, frames, pool, faceVisible);
+            QueryPerformanceCounter(&end);
+            ticks += end.QuadPart - start.QuadPart;
+        }
+        destroyWorkerPool(pool);
+
+        double ms = ticks * 1000.0 / counterFrequency.QuadPart / iterations;
+        if (threads == 1) baseMS = ms;
+        INFO(
+            "Recording %u draws on %u threads: %.3f ms (%.2fx)",
+            (u32)arrlenu(map.drawList),
+            threads,
+            ms,
+            ms > 0 ? baseMS / ms : 0.0
+        );
+        if (threads >= maxThreads) break;
+    }
+    frames.stats = {};
+    free(faceVisible);
+}
+
+// Requests the textures of visible faces, advances streaming and brings the
+// current frame's descriptor sets up to date with the sampler table. Must be
+// called after the frame's fence has been waited on.
+void
+streamMapTextures(
+    Vulkan& vk,
+    TextureStreamer& streamer,
+    Map& map,
+    FrameRing& frames,
+    VulkanSampler& placeholder,
+    VulkanSampler& missing,
+    u8* faceVisible
+) {
+    auto textures = map.data.textures;
+    for (u32 faceIdx = 0; faceIdx < map.data.faceCount; faceIdx++) {
+        auto& face = map.data.faces[faceIdx];
+        if ((face.type != 1 && face.type != 3) || !faceVisible[faceIdx]) continue;
+        auto slot = map.data.textureToSampler[face.texture];
+        if (slot < SAMPLER_PLACEHOLDER_COUNT) continue;
+        auto& texture = textures[slot - SAMPLER_PLACEHOLDER_COUNT];
+        texture.lastVisibleFrame = frames.count;
+        if (texture.residency == TEXTURE_UNLOADED) {
+            requestTexture(streamer, texture);
+        }
+    }
+
+    if (updateTextureStreaming(vk, streamer, textures, map.samplers, placeholder, missing, frames)) {
+        map.staleDescriptors = (1u << frames.depth) - 1;
+    }
+
+    u32 frameBit = 1u << frames.index;
+    if (map.staleDescriptors & frameBit) {
+        VkDescriptorSet sets[] = {
+            map.defaultDescriptorSets[frames.index],
+            map.modelDescriptorSets[frames.index]
+        };
+        for (u32 i = 0; i < 2; i++) {
+            updateCombinedImageSampler(
+                vk.device,
+                sets[i],
+                1,
+                map.samplers,
+                arrlenu(map.samplers)
+            );
+        }
+        map.staleDescriptors &= ~frameBit;
+    }
+}
+
+// Uploads as much of the map as fits in budgetTicks and returns true once the
+// map is ready to render. A budget of 0 uploads everything in one call. Every
+// step submits on the main queue, so this must run on the render thread between
+// frames.
+bool
+uploadMapStep(
+    Vulkan& vk,
+    Pipeline& defaultPipeline,
+    Pipeline& modelPipeline,
+    VulkanSampler* placeholders,
+    FrameRing& frames,
+    Map& map,
+    i64 budgetTicks
+) {
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    auto outOfTime = [&]() {
+        if (budgetTicks == 0) return false;
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        return now.QuadPart - start.QuadPart >= budgetTicks;
+    };
+
+    // Textures start out on the placeholder until they are streamed in.
+    if (map.stage == UPLOAD_SAMPLERS) {
+        arrsetlen(map.samplers, SAMPLER_PLACEHOLDER_COUNT + arrlenu(map.data.textures));
+        for (u32 i = 0; i < arrlenu(map.samplers); i++) {
+            map.samplers[i] = placeholders[i < SAMPLER_PLACEHOLDER_COUNT ? i : SAMPLER_STREAMING];
+        }
+        recordMemoryStage(map.data, "samplers");
+        map.stage = UPLOAD_LIGHTMAPS;
+        map.uploadIndex = 0;
+    }
+
+    if (map.stage == UPLOAD_LIGHTMAPS) {
+        arrsetlen(map.lightMapSamplers, map.data.lightMapCount);
+        while (map.uploadIndex < map.data.lightMapCount) {
+            auto& sampler = map.lightMapSamplers[map.uploadIndex];
+            uploadTexture(
+                vk.device,
+                vk.memories,
+                vk.queue,
+                vk.queueFamily,
+                vk.cmdPoolTransient,
+                128,
+                128,
+                map.data.lightMaps + map.uploadIndex * 128 * 128 * 4,
+                128 * 128 * 4,
+                sampler
+            );
+            trackDeviceMemory(map.data.memory, MEMORY_LIGHTMAPS, getImageMemorySize(vk, sampler.image));
+            map.uploadIndex++;
+            if (outOfTime()) return false;
+        }
+        free(map.data.lightMaps);
+        map.data.lightMaps = nullptr;
+        trackHeapMemory(map.data.memory, MEMORY_LIGHTMAPS, -(i64)map.data.lightMapCount * 128 * 128 * 4);
+        recordMemoryStage(map.data, "lightmaps");
+        INFO("Lightmaps uploaded");
+        map.stage = UPLOAD_MESH;
+    }
+
+    if (map.stage == UPLOAD_MESH) {
+        uploadMesh(
+            vk.device,
+            vk.memories,
+            vk.queueFamily,
+            map.data.vertices,
+            map.data.vertexCount*sizeof(BSPVertex),
+            map.data.indices,
+            arrlenu(map.data.indices)*sizeof(u32),
+            map.mesh
+        );
+        trackDeviceMemory(
+            map.data.memory,
+            MEMORY_GEOMETRY,
+            getBufferMemorySize(vk, map.mesh.vBuff) + getBufferMemorySize(vk, map.mesh.iBuff)
+        );
+        recordMemoryStage(map.data, "mesh");
+        map.stage = UPLOAD_DESCRIPTORS;
+        if (outOfTime()) return false;
+    }
+
+    if (map.stage == UPLOAD_DESCRIPTORS) {
+        Pipeline pipelines[] = {
+            defaultPipeline,
+            modelPipeline
+        };
+        auto pipelineCount = sizeof(pipelines) / sizeof(Pipeline);
+        map.descriptorPool = createDescriptorPool(vk, pipelines, pipelineCount, frames.depth);
+        arrsetlen(map.defaultDescriptorSets, frames.depth);
+        arrsetlen(map.modelDescriptorSets, frames.depth);
+        for (u32 frameIdx = 0; frameIdx < frames.depth; frameIdx++) {
+            map.defaultDescriptorSets[frameIdx] = allocateDescriptorSet(vk, map.descriptorPool, defaultPipeline);
+            map.modelDescriptorSets[frameIdx] = allocateDescriptorSet(vk, map.descriptorPool, modelPipeline);
+
+            VkDescriptorSet sets[] = {
+                map.defaultDescriptorSets[frameIdx],
+                map.modelDescriptorSets[frameIdx]
+            };
+            for (int i = 0; i < pipelineCount; i++) {
+                updateUniformBuffer(
+                    vk.device,
+                    sets[i],
+                    0,
+                    frames.frames[frameIdx].uniforms.handle
+                );
+                auto samplerCount = arrlenu(map.samplers);
+                updateCombinedImageSampler(
+                    vk.device,
+                    sets[i],
+                    1,
+                    map.samplers,
+                    samplerCount
+                );
+            }
+            auto lightMapSamplerCount = arrlenu(map.lightMapSamplers);
+            updateCombinedImageSampler(
+                vk.device,
+                map.defaultDescriptorSets[frameIdx],
+                2,
+                map.lightMapSamplers,
+                lightMapSamplerCount
+            );
+        }
+        recordMemoryStage(map.data, "descriptors");
+        map.stage = UPLOAD_DONE;
+    }
+
+    return true;
+}
+
+// Must only be called once no in-flight frame references the map.
+void
+destroyMap(
+    Vulkan& vk,
+    TextureStreamer& streamer,
+    Map* map
+) {
+    if (map->stage == UPLOAD_DONE) {
+        recordMemoryStage(map->data, "unloading");
+        writeMemoryReport(
+            map->data,
+            (u32)(arrlenu(map->samplers) + arrlenu(map->lightMapSamplers)),
+            (u32)(arrlenu(map->defaultDescriptorSets) + arrlenu(map->modelDescriptorSets))
+        );
+    }
+    auto memory = map->data.memory;
+    auto textures = map->data.textures;
+    cancelTextureRequests(streamer, textures, (u32)arrlenu(textures));
+    for (int i = 0; i < arrlen(textures); i++) {
+        auto& texture = textures[i];
+        if (texture.residency == TEXTURE_UPLOADING) {
+            finishTextureUpload(vk, texture.upload, true);
+        }
+        if (texture.residency == TEXTURE_UPLOADING || texture.residency == TEXTURE_RESIDENT) {
+            destroySampler(vk, texture.sampler, memory, MEMORY_TEXTURES);
+            streamer.residentBytes -= texture.upload.memorySize;
+        }
+    }
+    if (map->descriptorPool != VK_NULL_HANDLE) {
+        vkDestroyDescriptorPool(vk.device, map->descriptorPool, nullptr);
+    }
+    arrfree(map->defaultDescriptorSets);
+    arrfree(map->modelDescriptorSets);
+    arrfree(map->drawList);
+    if (map->stage > UPLOAD_MESH) {
+        destroyBuffer(vk, map->mesh.vBuff, memory, MEMORY_GEOMETRY);
+        destroyBuffer(vk, map->mesh.iBuff, memory, MEMORY_GEOMETRY);
+    }
+    for (int i = 0; i < arrlen(map->lightMapSamplers); i++) {
+        if (map->stage > UPLOAD_LIGHTMAPS || i < map->uploadIndex) {
+            destroySampler(vk, map->lightMapSamplers[i], memory, MEMORY_LIGHTMAPS);
+        }
+    }
+    arrfree(map->lightMapSamplers);
+    // NOTE: The sampler table only holds placeholders, which are shared
+    // between maps, and streamed textures, destroyed above.
+    arrfree(map->samplers);
+    freeMapData(map->data);
+    free(map);
+}
+
+// Loads every map in mapPaths in turn without rendering, streams in all of its
+// textures regardless of the budget, then unloads it, which writes its memory
+// report. The map that is already loaded is streamed in place and reported
+// when it is unloaded. Logs the map that needs the most memory. The device
+// must be idle.
+void
+reportMapMemory(
+    Vulkan& vk,
+    Pipeline& defaultPipeline,
+    Pipeline& modelPipeline,
+    VulkanSampler* placeholders,
+    FrameRing& frames,
+    WorkerPool& pool,
+    TextureStreamer& streamer,
+    PAK& pak,
+    char** mapPaths,
+    Map& current
+) {
+    u64 budget = streamer.budget;
+    streamer.budget = UINT64_MAX;
+    i64 worstHeap = 0;
+    i64 worstDevice = 0;
+    char worstHeapMap[64] = {};
+    char worstDeviceMap[64] = {};
+    for (int i = 0; i < arrlen(mapPaths); i++) {
+        auto map = &current;
+        if (_stricmp(mapPaths[i], current.data.path) != 0) {
+            MapLoader loader = {};
+            startMapLoad(pak, pool, mapPaths[i], loader);
+            waitForCounter(pool, loader.job);
+            map = loader.map;
+            if (!loader.succeeded) {
+                ERR("could not load '%s'", mapPaths[i]);
+                destroyMap(vk, streamer, map);
+                continue;
+            }
+            uploadMapStep(vk, defaultPipeline, modelPipeline, placeholders, frames, *map, 0);
+        }
+
+        u8* faceVisible = (u8*)malloc(map->data.faceCount);
+        memset(faceVisible, 1, map->data.faceCount);
+        for (;;) {
+            streamMapTextures(
+                vk,
+                streamer,
+                *map,
+                frames,
+                placeholders[SAMPLER_STREAMING],
+                placeholders[SAMPLER_MISSING_TEXTURE],
+                faceVisible
+            );
+            bool settled = true;
+            for (int t = 0; t < arrlen(map->data.textures); t++) {
+                auto residency = map->data.textures[t].residency;
+                if (residency != TEXTURE_RESIDENT && residency != TEXTURE_FAILED) {
+                    settled = false;
+                }
+            }
+            if (settled) break;
+            Sleep(1);
+        }
+        free(faceVisible);
+        VKCHECK(vkDeviceWaitIdle(vk.device));
+
+        i64 heap = map->data.memory->heapTotalPeak.load();
+        i64 device = map->data.memory->deviceTotalPeak.load();
+        if (heap > worstHeap) {
+            worstHeap = heap;
+            strncpy_s(worstHeapMap, map->data.path, sizeof(worstHeapMap) - 1);
+        }
+        if (device > worstDevice) {
+            worstDevice = device;
+            strncpy_s(worstDeviceMap, map->data.path, sizeof(worstDeviceMap) - 1);
+        }
+        if (map != &current) {
+            destroyMap(vk, streamer, map);
+        }
+    }
+    streamer.budget = budget;
+
+    double toMB = 1.0 / (1024 * 1024);
+    INFO(
+        "Worst case over %u maps: %.1f MB heap ('%s'), %.1f MB device ('%s'), plus %.1f MB heap and %.1f MB device shared",
+        (u32)arrlenu(mapPaths),
+        worstHeap * toMB,
+        worstHeapMap,
+        worstDevice * toMB,
+        worstDeviceMap,
+        sharedMemory.heapTotalPeak.load() * toMB,
+        sharedMemory.deviceTotalPeak.load() * toMB
+    );
+}
+
+void
+findSpawn(
+    MapData& map,
+    Vec4& eye,
+    float& angle
+) {
+    for (int i = 0; i < arrlen(map.entities); i++) {
+        auto& entity = map.entities[i];
+        if (strcmp(entity.className, "info_player_deathmatch") == 0) {
+            eye.x = entity.origin.x;
+            eye.y = entity.origin.y;
+            eye.z = entity.origin.z;
+            angle = (float)entity.angle;
+            return;
+        }
+    }
+}
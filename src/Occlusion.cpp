@@ -0,0 +1,603 @@
+#include <float.h>
+
+// NOTE: Software occlusion culling. The largest occluder polygons are
+// rasterized into a small depth buffer on the CPU, a min/max pyramid is built
+// over it and the bounding box of every BSP leaf is tested against the
+// pyramid. A face is drawn if any leaf it belongs to survives.
+//
+// The buffer holds 1/w: larger is nearer, and a cleared texel (0) is
+// infinitely far away.
+const u32 OCCLUSION_WIDTH = 256;
+const u32 OCCLUSION_MAX_LEVELS = 12;
+// Occluders are clipped this far in front of the eye, and boxes that reach
+// closer than this are always visible.
+const float OCCLUSION_NEAR = 1.f;
+const u32 OCCLUSION_LEAVES_PER_TASK = 64;
+const u32 OCCLUSION_MIN_BUDGET = 64;
+
+struct OcclusionLevel {
+    u32 width;
+    u32 height;
+    // Farthest and nearest texel below each texel of this level. Both point
+    // at the depth buffer itself on level 0.
+    float* minDepth;
+    float* maxDepth;
+};
+
+struct OcclusionStats {
+    u32 frames;
+    i64 ticks;
+    i64 maxTicks;
+    u64 occluders;
+    u64 leaves;
+    u64 leavesRejected;
+    u64 faces;
+    u64 facesDrawn;
+};
+
+struct Occlusion {
+    bool enabled;
+    u32 width;
+    u32 height;
+    OcclusionLevel levels[OCCLUSION_MAX_LEVELS];
+    u32 levelCount;
+    // World (in the space the vertex shader starts from) to clip space,
+    // column-major like Uniforms.proj.
+    float transform[16];
+    u8* leafVisible;
+    u8* faceVisible;
+    // Occluder triangles rasterized per frame. Adjusted to keep culling
+    // within budgetTicks.
+    u32 occluderBudget;
+    i64 budgetTicks;
+    OcclusionStats window;
+    i64 windowStart;
+    OcclusionStats total;
+};
+
+void
+createOcclusion(
+    u32 viewWidth,
+    u32 viewHeight,
+    bool enabled,
+    Occlusion& occlusion
+) {
+    occlusion = {};
+    occlusion.enabled = enabled;
+    occlusion.width = OCCLUSION_WIDTH;
+    occlusion.height = OCCLUSION_WIDTH * viewHeight / viewWidth;
+    if (occlusion.height < 1) occlusion.height = 1;
+    occlusion.occluderBudget = 1024;
+    occlusion.budgetTicks = counterFrequency.QuadPart / 1000;
+
+    u32 width = occlusion.width;
+    u32 height = occlusion.height;
+    float* depth = (float*)malloc(width * height * sizeof(float));
+    occlusion.levels[0] = { width, height, depth, depth };
+    occlusion.levelCount = 1;
+    while ((width > 1 || height > 1) && occlusion.levelCount < OCCLUSION_MAX_LEVELS) {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        auto& level = occlusion.levels[occlusion.levelCount++];
+        level.width = width;
+        level.height = height;
+        level.minDepth = (float*)malloc(width * height * sizeof(float));
+        level.maxDepth = (float*)malloc(width * height * sizeof(float));
+    }
+    INFO(
+        "Occlusion buffer %ux%u, %u levels%s",
+        occlusion.width,
+        occlusion.height,
+        occlusion.levelCount,
+        enabled ? "" : " (culling disabled)"
+    );
+}
+
+void
+destroyOcclusion(
+    Occlusion& occlusion
+) {
+    free(occlusion.levels[0].minDepth);
+    for (u32 i = 1; i < occlusion.levelCount; i++) {
+        free(occlusion.levels[i].minDepth);
+        free(occlusion.levels[i].maxDepth);
+    }
+    arrfree(occlusion.leafVisible);
+    arrfree(occlusion.faceVisible);
+    occlusion = {};
+}
+
+// Rotates v the way rotate_vertex_position does in the shaders.
+Vec3
+rotateByQuaternion(
+    Quaternion& q,
+    Vec3 v
+) {
+    // t = q * (v, 0)
+    float tx =  q.w * v.x + q.y * v.z - q.z * v.y;
+    float ty =  q.w * v.y - q.x * v.z + q.z * v.x;
+    float tz =  q.w * v.z + q.x * v.y - q.y * v.x;
+    float tw = -q.x * v.x - q.y * v.y - q.z * v.z;
+    // t * conj(q)
+    return {
+        -tw * q.x + tx * q.w - ty * q.z + tz * q.y,
+        -tw * q.y + tx * q.z + ty * q.w - tz * q.x,
+        -tw * q.z - tx * q.y + ty * q.x + tz * q.w
+    };
+}
+
+// Folds the shader's eye offset, quaternion rotation and projection into a
+// single matrix.
+void
+computeOcclusionTransform(
+    Uniforms& uniforms,
+    float* transform
+) {
+    float view[16] = {};
+    Vec3 axes[3] = {
+        rotateByQuaternion(uniforms.rotation, { 1, 0, 0 }),
+        rotateByQuaternion(uniforms.rotation, { 0, 1, 0 }),
+        rotateByQuaternion(uniforms.rotation, { 0, 0, 1 })
+    };
+    Vec3 eye = rotateByQuaternion(
+        uniforms.rotation,
+        { uniforms.eye.x, uniforms.eye.y, uniforms.eye.z }
+    );
+    for (u32 c = 0; c < 3; c++) {
+        view[c * 4 + 0] = axes[c].x;
+        view[c * 4 + 1] = axes[c].y;
+        view[c * 4 + 2] = axes[c].z;
+    }
+    view[12] = -eye.x;
+    view[13] = -eye.y;
+    view[14] = -eye.z;
+    view[15] = 1.f - uniforms.eye.w;
+
+    for (u32 c = 0; c < 4; c++) {
+        for (u32 row = 0; row < 4; row++) {
+            float sum = 0;
+            for (u32 k = 0; k < 4; k++) {
+                sum += uniforms.proj[k * 4 + row] * view[c * 4 + k];
+            }
+            transform[c * 4 + row] = sum;
+        }
+    }
+}
+
+inline __m128
+transformToClip(
+    float* m,
+    Vec3& p
+) {
+    __m128 clip = _mm_loadu_ps(m + 12);
+    clip = _mm_add_ps(clip, _mm_mul_ps(_mm_loadu_ps(m + 0), _mm_set1_ps(p.x)));
+    clip = _mm_add_ps(clip, _mm_mul_ps(_mm_loadu_ps(m + 4), _mm_set1_ps(p.y)));
+    clip = _mm_add_ps(clip, _mm_mul_ps(_mm_loadu_ps(m + 8), _mm_set1_ps(p.z)));
+    return clip;
+}
+
+// Screen position in buffer texels and 1/w of a vertex in front of the near
+// plane.
+struct OcclusionVertex {
+    float x;
+    float y;
+    float z;
+};
+
+inline OcclusionVertex
+projectToOcclusion(
+    Occlusion& occlusion,
+    float* clip
+) {
+    float invW = 1.f / clip[3];
+    return {
+        (clip[0] * invW * .5f + .5f) * occlusion.width,
+        (clip[1] * invW * .5f + .5f) * occlusion.height,
+        invW
+    };
+}
+
+// Rasterizes a triangle into rows [y0, y1) of the depth buffer, sampling at
+// texel centers and keeping the nearest depth.
+void
+rasterizeOcclusionTriangle(
+    Occlusion& occlusion,
+    OcclusionVertex a,
+    OcclusionVertex b,
+    OcclusionVertex c,
+    i32 y0,
+    i32 y1
+) {
+    float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    if (area == 0) return;
+    // Occluders are drawn from both sides.
+    if (area < 0) {
+        auto t = b;
+        b = c;
+        c = t;
+        area = -area;
+    }
+
+    i32 minX = (i32)floorf(fminf(a.x, fminf(b.x, c.x)));
+    i32 maxX = (i32)ceilf(fmaxf(a.x, fmaxf(b.x, c.x)));
+    i32 minY = (i32)floorf(fminf(a.y, fminf(b.y, c.y)));
+    i32 maxY = (i32)ceilf(fmaxf(a.y, fmaxf(b.y, c.y)));
+    if (minX < 0) minX = 0;
+    if (maxX > (i32)occlusion.width - 1) maxX = occlusion.width - 1;
+    if (minY < y0) minY = y0;
+    if (maxY > y1 - 1) maxY = y1 - 1;
+    if (minX > maxX || minY > maxY) return;
+
+    // Edge functions, positive inside: E(x, y) = A * x + B * y + C.
+    OcclusionVertex* edges[3][2] = { { &b, &c }, { &c, &a }, { &a, &b } };
+    float A[3], B[3], C[3];
+    for (u32 i = 0; i < 3; i++) {
+        auto& p = *edges[i][0];
+        auto& q = *edges[i][1];
+        A[i] = p.y - q.y;
+        B[i] = q.x - p.x;
+        C[i] = -(A[i] * p.x + B[i] * p.y);
+    }
+    // Depth is linear in screen space; edge i weights the vertex opposite it.
+    float invArea = 1.f / area;
+    float zA = (A[0] * a.z + A[1] * b.z + A[2] * c.z) * invArea;
+    float zB = (B[0] * a.z + B[1] * b.z + B[2] * c.z) * invArea;
+    float zC = (C[0] * a.z + C[1] * b.z + C[2] * c.z) * invArea;
+
+    // NOTE: The buffer width is a multiple of 4, so a group of four texels
+    // starting on a multiple of 4 never runs past the end of a row.
+    i32 startX = minX & ~3;
+    __m128 offsets = _mm_setr_ps(.5f, 1.5f, 2.5f, 3.5f);
+    __m128 xs = _mm_add_ps(_mm_set1_ps((float)startX), offsets);
+    __m128 zero = _mm_setzero_ps();
+    __m128 e0Step = _mm_set1_ps(A[0] * 4);
+    __m128 e1Step = _mm_set1_ps(A[1] * 4);
+    __m128 e2Step = _mm_set1_ps(A[2] * 4);
+    __m128 zStep = _mm_set1_ps(zA * 4);
+    auto depth = occlusion.levels[0].minDepth;
+    for (i32 y = minY; y <= maxY; y++) {
+        float py = y + .5f;
+        __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[0]), xs), _mm_set1_ps(B[0] * py + C[0]));
+        __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[1]), xs), _mm_set1_ps(B[1] * py + C[1]));
+        __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[2]), xs), _mm_set1_ps(B[2] * py + C[2]));
+        __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zA), xs), _mm_set1_ps(zB * py + zC));
+        float* row = depth + y * occlusion.width;
+        for (i32 x = startX; x <= maxX; x += 4) {
+            __m128 inside = _mm_and_ps(
+                _mm_cmpge_ps(e0, zero),
+                _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero))
+            );
+            if (_mm_movemask_ps(inside)) {
+                __m128 current = _mm_loadu_ps(row + x);
+                __m128 nearest = _mm_max_ps(current, z);
+                _mm_storeu_ps(row + x, _mm_or_ps(
+                    _mm_and_ps(inside, nearest),
+                    _mm_andnot_ps(inside, current)
+                ));
+            }
+            e0 = _mm_add_ps(e0, e0Step);
+            e1 = _mm_add_ps(e1, e1Step);
+            e2 = _mm_add_ps(e2, e2Step);
+            z = _mm_add_ps(z, zStep);
+        }
+    }
+}
+
+// Clears rows [y0, y1) and draws every occluder triangle that touches them.
+void
+rasterizeOccluders(
+    Occlusion& occlusion,
+    Vec3* occluders,
+    u32 triangleCount,
+    i32 y0,
+    i32 y1
+) {
+    memset(
+        occlusion.levels[0].minDepth + y0 * occlusion.width,
+        0,
+        (y1 - y0) * occlusion.width * sizeof(float)
+    );
+
+    for (u32 t = 0; t < triangleCount; t++) {
+        float clip[3][4];
+        for (u32 i = 0; i < 3; i++) {
+            _mm_storeu_ps(clip[i], transformToClip(occlusion.transform, occluders[t * 3 + i]));
+        }
+
+        // Clip against the near plane, which can add one vertex.
+        OcclusionVertex polygon[4];
+        u32 count = 0;
+        for (u32 i = 0; i < 3; i++) {
+            float* p = clip[i];
+            float* q = clip[(i + 1) % 3];
+            float dp = p[3] - OCCLUSION_NEAR;
+            float dq = q[3] - OCCLUSION_NEAR;
+            if (dp >= 0) {
+                polygon[count++] = projectToOcclusion(occlusion, p);
+            }
+            if ((dp >= 0) != (dq >= 0)) {
+                float s = dp / (dp - dq);
+                float split[4];
+                for (u32 j = 0; j < 4; j++) {
+                    split[j] = p[j] + (q[j] - p[j]) * s;
+                }
+                polygon[count++] = projectToOcclusion(occlusion, split);
+            }
+        }
+        for (u32 i = 1; i + 1 < count; i++) {
+            rasterizeOcclusionTriangle(occlusion, polygon[0], polygon[i], polygon[i + 1], y0, y1);
+        }
+    }
+}
+
+void
+buildOcclusionLevels(
+    Occlusion& occlusion
+) {
+    for (u32 l = 1; l < occlusion.levelCount; l++) {
+        auto& src = occlusion.levels[l - 1];
+        auto& dst = occlusion.levels[l];
+        for (u32 y = 0; y < dst.height; y++) {
+            u32 sy0 = y * 2;
+            u32 sy1 = sy0 + 1 < src.height ? sy0 + 1 : sy0;
+            for (u32 x = 0; x < dst.width; x++) {
+                u32 sx0 = x * 2;
+                u32 sx1 = sx0 + 1 < src.width ? sx0 + 1 : sx0;
+                u32 i00 = sy0 * src.width + sx0;
+                u32 i01 = sy0 * src.width + sx1;
+                u32 i10 = sy1 * src.width + sx0;
+                u32 i11 = sy1 * src.width + sx1;
+                dst.minDepth[y * dst.width + x] = fminf(
+                    fminf(src.minDepth[i00], src.minDepth[i01]),
+                    fminf(src.minDepth[i10], src.minDepth[i11])
+                );
+                dst.maxDepth[y * dst.width + x] = fmaxf(
+                    fmaxf(src.maxDepth[i00], src.maxDepth[i01]),
+                    fmaxf(src.maxDepth[i10], src.maxDepth[i11])
+                );
+            }
+        }
+    }
+}
+
+// True if something at depth could show through the texel (tx, ty) of level,
+// looking only at the part of it inside the level 0 rectangle [x0, x1] x
+// [y0, y1].
+bool
+testOcclusionTile(
+    Occlusion& occlusion,
+    u32 level,
+    i32 tx,
+    i32 ty,
+    i32 x0,
+    i32 y0,
+    i32 x1,
+    i32 y1,
+    float depth
+) {
+    auto& tiles = occlusion.levels[level];
+    u32 index = ty * tiles.width + tx;
+    if (depth < tiles.minDepth[index]) return false;
+    if (depth >= tiles.maxDepth[index] || level == 0) return true;
+
+    u32 child = level - 1;
+    i32 cx0 = x0 >> child > tx * 2 ? x0 >> child : tx * 2;
+    i32 cx1 = x1 >> child < tx * 2 + 1 ? x1 >> child : tx * 2 + 1;
+    i32 cy0 = y0 >> child > ty * 2 ? y0 >> child : ty * 2;
+    i32 cy1 = y1 >> child < ty * 2 + 1 ? y1 >> child : ty * 2 + 1;
+    for (i32 cy = cy0; cy <= cy1; cy++) {
+        for (i32 cx = cx0; cx <= cx1; cx++) {
+            if (testOcclusionTile(occlusion, child, cx, cy, x0, y0, x1, y1, depth)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Tests an axis-aligned box, given in the space the vertex shader starts from.
+bool
+testOcclusionBox(
+    Occlusion& occlusion,
+    Vec3 mins,
+    Vec3 maxs
+) {
+    float minX = FLT_MAX, minY = FLT_MAX;
+    float maxX = -FLT_MAX, maxY = -FLT_MAX;
+    float depth = 0;
+    u32 behind = 0;
+    for (u32 i = 0; i < 8; i++) {
+        Vec3 corner = {
+            i & 1 ? maxs.x : mins.x,
+            i & 2 ? maxs.y : mins.y,
+            i & 4 ? maxs.z : mins.z
+        };
+        float clip[4];
+        _mm_storeu_ps(clip, transformToClip(occlusion.transform, corner));
+        if (clip[3] < OCCLUSION_NEAR) {
+            behind++;
+            continue;
+        }
+        auto p = projectToOcclusion(occlusion, clip);
+        minX = fminf(minX, p.x);
+        maxX = fmaxf(maxX, p.x);
+        minY = fminf(minY, p.y);
+        maxY = fmaxf(maxY, p.y);
+        depth = fmaxf(depth, p.z);
+    }
+    // Entirely behind the eye, or too close to tell.
+    if (behind == 8) return false;
+    if (behind > 0) return true;
+    if (maxX < 0 || maxY < 0 || minX >= occlusion.width || minY >= occlusion.height) {
+        return false;
+    }
+
+    i32 x0 = minX < 0 ? 0 : (i32)minX;
+    i32 y0 = minY < 0 ? 0 : (i32)minY;
+    i32 x1 = maxX >= occlusion.width ? occlusion.width - 1 : (i32)maxX;
+    i32 y1 = maxY >= occlusion.height ? occlusion.height - 1 : (i32)maxY;
+
+    // Start on the finest level where the box covers at most 2x2 texels.
+    u32 level = 0;
+    while (level + 1 < occlusion.levelCount &&
+        ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1)) {
+        level++;
+    }
+    for (i32 ty = y0 >> level; ty <= y1 >> level; ty++) {
+        for (i32 tx = x0 >> level; tx <= x1 >> level; tx++) {
+            if (testOcclusionTile(occlusion, level, tx, ty, x0, y0, x1, y1, depth)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void
+recordOcclusionStats(
+    OcclusionStats& stats,
+    OcclusionStats& frame
+) {
+    stats.frames++;
+    stats.ticks += frame.ticks;
+    if (frame.ticks > stats.maxTicks) {
+        stats.maxTicks = frame.ticks;
+    }
+    stats.occluders += frame.occluders;
+    stats.leaves += frame.leaves;
+    stats.leavesRejected += frame.leavesRejected;
+    stats.faces += frame.faces;
+    stats.facesDrawn += frame.facesDrawn;
+}
+
+void
+logOcclusionStats(
+    const char* label,
+    OcclusionStats& stats
+) {
+    if (stats.frames == 0) return;
+    double toMS = 1000.0 / counterFrequency.QuadPart;
+    INFO(
+        "%s: %u frames, cull avg %.3f ms max %.3f ms, %.0f occluder triangles, leaves rejected %.0f/%.0f, faces drawn %.0f/%.0f",
+        label,
+        stats.frames,
+        stats.ticks * toMS / stats.frames,
+        stats.maxTicks * toMS,
+        (double)stats.occluders / stats.frames,
+        (double)stats.leavesRejected / stats.frames,
+        (double)stats.leaves / stats.frames,
+        (double)stats.facesDrawn / stats.frames,
+        (double)stats.faces / stats.frames
+    );
+}
+
+// Fills occlusion.faceVisible for the view in uniforms. With culling disabled
+// every face is marked visible, and only the face counts are recorded.
+void
+cullMap(
+    Occlusion& occlusion,
+    WorkerPool& pool,
+    MapData& map,
+    Uniforms& uniforms
+) {
+    arrsetlen(occlusion.faceVisible, map.faceCount);
+    arrsetlen(occlusion.leafVisible, map.leafCount);
+
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    OcclusionStats frame = {};
+    if (!occlusion.enabled) {
+        memset(occlusion.faceVisible, 1, map.faceCount);
+    } else {
+        computeOcclusionTransform(uniforms, occlusion.transform);
+
+        // Rasterize in horizontal bands so that threads never share a row.
+        u32 triangleCount = (u32)arrlenu(map.occluders) / 3;
+        if (triangleCount > occlusion.occluderBudget) {
+            triangleCount = occlusion.occluderBudget;
+        }
+        u32 bandCount = getWorkerCount(pool) * 2;
+        if (bandCount > occlusion.height) bandCount = occlusion.height;
+        u32 bandHeight = (occlusion.height + bandCount - 1) / bandCount;
+        parallelFor(pool, bandCount, [&](u32 band) {
+            u32 y0 = band * bandHeight;
+            u32 y1 = y0 + bandHeight < occlusion.height ? y0 + bandHeight : occlusion.height;
+            if (y0 < y1) {
+                rasterizeOccluders(occlusion, map.occluders, triangleCount, y0, y1);
+            }
+        });
+        buildOcclusionLevels(occlusion);
+
+        u32 taskCount = (map.leafCount + OCCLUSION_LEAVES_PER_TASK - 1) / OCCLUSION_LEAVES_PER_TASK;
+        parallelFor(pool, taskCount, [&](u32 task) {
+            u32 first = task * OCCLUSION_LEAVES_PER_TASK;
+            u32 end = first + OCCLUSION_LEAVES_PER_TASK < map.leafCount
+                ? first + OCCLUSION_LEAVES_PER_TASK
+                : map.leafCount;
+            for (u32 i = first; i < end; i++) {
+                auto& leaf = map.leaves[i];
+                // NOTE: Leaves in solid space have no cluster and nothing to draw.
+                if (leaf.cluster < 0 || leaf.leafFaceCount == 0) {
+                    occlusion.leafVisible[i] = 0;
+                    continue;
+                }
+                Vec3 mins = { (float)leaf.mins[0], (float)-leaf.maxs[2], (float)leaf.mins[1] };
+                Vec3 maxs = { (float)leaf.maxs[0], (float)-leaf.mins[2], (float)leaf.maxs[1] };
+                occlusion.leafVisible[i] = testOcclusionBox(occlusion, mins, maxs);
+            }
+        });
+
+        frame.occluders = triangleCount;
+        for (u32 i = 0; i < map.faceCount; i++) {
+            occlusion.faceVisible[i] = !map.faceInLeaf[i];
+        }
+        for (u32 i = 0; i < map.leafCount; i++) {
+            auto& leaf = map.leaves[i];
+            if (leaf.cluster < 0 || leaf.leafFaceCount == 0) continue;
+            frame.leaves++;
+            if (!occlusion.leafVisible[i]) {
+                frame.leavesRejected++;
+                continue;
+            }
+            for (i32 j = 0; j < leaf.leafFaceCount; j++) {
+                occlusion.faceVisible[map.leafFaces[leaf.leafFace + j]] = 1;
+            }
+        }
+    }
+    for (u32 i = 0; i < map.faceCount; i++) {
+        auto type = map.faces[i].type;
+        if (type != 1 && type != 3) continue;
+        frame.faces++;
+        frame.facesDrawn += occlusion.faceVisible[i];
+    }
+
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+    frame.ticks = end.QuadPart - start.QuadPart;
+
+    // Trade occluders for time: back off quickly when over budget and grow
+    // slowly while well under it.
+    if (occlusion.enabled) {
+        u32 available = (u32)arrlenu(map.occluders) / 3;
+        if (frame.ticks > occlusion.budgetTicks) {
+            occlusion.occluderBudget -= occlusion.occluderBudget / 4;
+            if (occlusion.occluderBudget < OCCLUSION_MIN_BUDGET) {
+                occlusion.occluderBudget = OCCLUSION_MIN_BUDGET;
+            }
+        } else if (frame.ticks < occlusion.budgetTicks / 2 && occlusion.occluderBudget < available) {
+            occlusion.occluderBudget += occlusion.occluderBudget / 16 + 16;
+        }
+    }
+
+    recordOcclusionStats(occlusion.window, frame);
+    recordOcclusionStats(occlusion.total, frame);
+    if (occlusion.windowStart == 0) {
+        occlusion.windowStart = end.QuadPart;
+    }
+    if (end.QuadPart - occlusion.windowStart >= counterFrequency.QuadPart) {
+        logOcclusionStats("occlusion", occlusion.window);
+        occlusion.window = {};
+        occlusion.windowStart = end.QuadPart;
+    }
+}
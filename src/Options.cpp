@@ -0,0 +1,150 @@
+struct Options {
+    char map[64];
+    u32 framesInFlight;
+    u32 maxFPS;
+    FramePacing pacing;
+    TextureSettings textures;
+    u32 textureBudgetMB;
+    bool benchmarkJPEG;
+    bool testJPEG;
+    bool verifyPAK;
+    bool memoryReport;
+    bool benchmarkRecording;
+    bool benchmarkJobs;
+    // Rounds of the job system stress test to run, 0 for none.
+    u32 stressJobs;
+    // Threads in the job system, 0 for one per core.
+    u32 threads;
+    bool cull;
+    char recordPath[64];
+    char replayPath[64];
+};
+
+// Reads the next space-separated token from the command line into token and
+// returns a pointer past it, or nullptr when there are no tokens left.
+char*
+nextToken(
+    char* ptr,
+    char* token,
+    size_t tokenSize
+) {
+    while (*ptr == ' ' || *ptr == '\t') ptr++;
+    if (*ptr == '\0') return nullptr;
+    size_t length = 0;
+    while (*ptr != '\0' && *ptr != ' ' && *ptr != '\t') {
+        if (length < tokenSize - 1) token[length++] = *ptr;
+        ptr++;
+    }
+    token[length] = '\0';
+    return ptr;
+}
+
+// Parses token as a whole number in [min, max] into value. Leaves value as it
+// was and returns false if token is not a number or is out of range.
+bool
+parseCount(
+    const char* option,
+    const char* token,
+    u32 min,
+    u32 max,
+    u32& value
+) {
+    char* end;
+    long long parsed = strtoll(token, &end, 10);
+    if (end == token || *end != '\0' || parsed < min || parsed > max) {
+        ERR("%s needs a number from %u to %u, not '%s'", option, min, max, token);
+        return false;
+    }
+    value = (u32)parsed;
+    return true;
+}
+
+// Usage: main [map] [-frames N] [-fps N] [-pacing none|present]
+//             [-mips none|box|kaiser] [-compress] [-nocache] [-jpegbench]
+//             [-nocull] [-record FILE] [-replay FILE] [-threads N]
+//             [-recordbench] [-vram MB] [-jobbench] [-jobstress N]
+//             [-verifypak] [-memreport] [-jpegtest]
+void
+parseOptions(
+    char* commandLine,
+    Options& options
+) {
+    options = {};
+    strncpy_s(options.map, "q3dm17", sizeof(options.map) - 1);
+    options.framesInFlight = 2;
+    options.textures.mipFilter = MIP_BOX;
+    options.textures.cache = true;
+    options.textureBudgetMB = 256;
+    options.cull = true;
+
+    if (commandLine == nullptr) return;
+
+    char token[64];
+    char* ptr = commandLine;
+    while ((ptr = nextToken(ptr, token, sizeof(token))) != nullptr) {
+        if (strcmp(token, "-frames") == 0) {
+            ptr = nextToken(ptr, token, sizeof(token));
+            if (ptr == nullptr) FATAL("-frames needs a value");
+            parseCount("-frames", token, 1, 16, options.framesInFlight);
+        } else if (strcmp(token, "-fps") == 0) {
+            ptr = nextToken(ptr, token, sizeof(token));
+            if (ptr == nullptr) FATAL("-fps needs a value");
+            parseCount("-fps", token, 1, 1000, options.maxFPS);
+        } else if (strcmp(token, "-pacing") == 0) {
+            ptr = nextToken(ptr, token, sizeof(token));
+            if (ptr == nullptr) FATAL("-pacing needs a value");
+            if (strcmp(token, "present") == 0) options.pacing = PACING_PRESENT;
+            else if (strcmp(token, "none") == 0) options.pacing = PACING_NONE;
+            else ERR("unknown pacing mode '%s'", token);
+        } else if (strcmp(token, "-mips") == 0) {
+            ptr = nextToken(ptr, token, sizeof(token));
+            if (ptr == nullptr) FATAL("-mips needs a value");
+            if (strcmp(token, "none") == 0) options.textures.mipFilter = MIP_NONE;
+            else if (strcmp(token, "box") == 0) options.textures.mipFilter = MIP_BOX;
+            else if (strcmp(token, "kaiser") == 0) options.textures.mipFilter = MIP_KAISER;
+            else ERR("unknown mip filter '%s'", token);
+        } else if (strcmp(token, "-compress") == 0) {
+            options.textures.compress = true;
+        } else if (strcmp(token, "-nocache") == 0) {
+            options.textures.cache = false;
+        } else if (strcmp(token, "-vram") == 0) {
+            ptr = nextToken(ptr, token, sizeof(token));
+            if (ptr == nullptr) FATAL("-vram needs a value");
+            parseCount("-vram", token, 1, 65536, options.textureBudgetMB);
+        } else if (strcmp(token, "-jpegbench") == 0) {
+            options.benchmarkJPEG = true;
+        } else if (strcmp(token, "-jpegtest") == 0) {
+            options.testJPEG = true;
+        } else if (strcmp(token, "-memreport") == 0) {
+            options.memoryReport = true;
+        } else if (strcmp(token, "-verifypak") == 0) {
+            options.verifyPAK = true;
+        } else if (strcmp(token, "-recordbench") == 0) {
+            options.benchmarkRecording = true;
+        } else if (strcmp(token, "-jobbench") == 0) {
+            options.benchmarkJobs = true;
+        } else if (strcmp(token, "-jobstress") == 0) {
+            ptr = nextToken(ptr, token, sizeof(token));
+            if (ptr == nullptr) FATAL("-jobstress needs a value");
+            parseCount("-jobstress", token, 1, 1000000, options.stressJobs);
+        } else if (strcmp(token, "-threads") == 0) {
+            ptr = nextToken(ptr, token, sizeof(token));
+            if (ptr == nullptr) FATAL("-threads needs a value");
+            parseCount("-threads", token, 1, 256, options.threads);
+        } else if (strcmp(token, "-nocull") == 0) {
+            options.cull = false;
+        } else if (strcmp(token, "-record") == 0) {
+            ptr = nextToken(ptr, token, sizeof(token));
+            if (ptr == nullptr) FATAL("-record needs a file");
+            strncpy_s(options.recordPath, token, sizeof(options.recordPath) - 1);
+        } else if (strcmp(token, "-replay") == 0) {
+            ptr = nextToken(ptr, token, sizeof(token));
+            if (ptr == nullptr) FATAL("-replay needs a file");
+            strncpy_s(options.replayPath, token, sizeof(options.replayPath) - 1);
+        } else if (token[0] == '-') {
+            ERR("unknown option '%s'", token);
+        } else {
+            strncpy_s(options.map, token, sizeof(options.map) - 1);
+        }
+    }
+}
@@ -0,0 +1,259 @@
+struct PAK {
+    char* bytes;
+    u64 size;
+    EOCD* eocd;
+};
+
+void
+openPAK(
+    const char* fname,
+    PAK& pak
+) {
+    struct _stat stat = {};
+    LERROR(_stat(fname, &stat))
+
+    FILE* pakFile;
+    LERROR(fopen_s(&pakFile, fname, "rb"));
+    INFO("File opened");
+
+    // TODO: This malloc is relatively expensive, as is the read following it.
+    // It might be worth checking to see if mmap (or the Windows equivalent)
+    // is faster since the program is reading relatively small chunks of data
+    // in a random pattern instead of sequentially going through the whole
+    // ~400 MB file.
+    pak.bytes = (char*)malloc(stat.st_size);
+    INFO("Data allocated");
+
+    auto bytesRead = fread(pak.bytes, 1, stat.st_size, pakFile);
+    LERROR(bytesRead != stat.st_size);
+    fclose(pakFile);
+    pak.size = bytesRead;
+    trackHeapMemory(&sharedMemory, MEMORY_ARCHIVE, bytesRead);
+    INFO("PAK file read");
+
+    if (strncmp(pak.bytes, "PK", 2)) {
+        FATAL("not a zip file");
+    }
+
+    if (pak.bytes[2] != 0x03) {
+        FATAL("wrong zip version: %d", pak.bytes[2]);
+    }
+
+    auto c = pak.bytes + bytesRead - 1;
+    while ((c[0] != 'P') &&
+        (c[1] != 'K') &&
+        (c[2] != 5) &&
+        (c[3] != 6) &&
+        (c > pak.bytes + 4)) {
+        c--;
+    }
+
+    auto offset = c - bytesRead;
+    if (offset == 0) {
+        FATAL("invalid zip, no EOCD");
+    }
+
+    pak.eocd = READ(c, EOCD, 0);
+}
+
+CDRecord*
+findFileInPAK(
+    char* pakBytes,
+    EOCD& eocd,
+    const char* path
+) {
+    auto pathLength = strlen(path);
+    u16 index = 0;
+    char* ptr = pakBytes + eocd.cdrOffset;
+    CDRecord* record;
+    while (index < eocd.cdrCount) {
+        record = (CDRecord*)ptr;
+        char* fname = ptr + sizeof(CDRecord);
+        auto maxLen = pathLength <= record->fnameLength
+            ? pathLength
+            : record->fnameLength;
+        if ((record->fnameLength >= pathLength) &&
+            (strncmp(path, fname, maxLen) == 0))
+            return record;
+        ptr += sizeof(CDRecord);
+        ptr += record->fnameLength;
+        ptr += record->extraFieldLength;
+        ptr += record->fileCommentLength;
+        index++;
+    }
+    return nullptr;
+}
+
+// Returns an stb_ds array of zero-terminated paths for every entry whose name
+// starts with prefix and ends with suffix. Free with freePAKFileList.
+char**
+listFilesInPAK(
+    PAK& pak,
+    const char* prefix,
+    const char* suffix
+) {
+    char** result = NULL;
+    auto prefixLength = strlen(prefix);
+    auto suffixLength = strlen(suffix);
+    char* ptr = pak.bytes + pak.eocd->cdrOffset;
+    for (u16 index = 0; index < pak.eocd->cdrCount; index++) {
+        auto record = (CDRecord*)ptr;
+        char* fname = ptr + sizeof(CDRecord);
+        u16 fnameLength = record->fnameLength;
+        if ((fnameLength >= prefixLength + suffixLength) &&
+            (strncmp(fname, prefix, prefixLength) == 0) &&
+            (_strnicmp(fname + fnameLength - suffixLength, suffix, suffixLength) == 0)) {
+            auto path = (char*)malloc(fnameLength + 1);
+            memcpy(path, fname, fnameLength);
+            path[fnameLength] = '\0';
+            arrput(result, path);
+        }
+        ptr += sizeof(CDRecord);
+        ptr += record->fnameLength;
+        ptr += record->extraFieldLength;
+        ptr += record->fileCommentLength;
+    }
+    return result;
+}
+
+void
+freePAKFileList(
+    char** files
+) {
+    for (int i = 0; i < arrlen(files); i++) {
+        free(files[i]);
+    }
+    arrfree(files);
+}
+
+u8*
+unpackFile(
+    char* pakBytes,
+    CDRecord* record,
+    u32* uncompressedLength = NULL
+) {
+    auto localHeader = (LocalFileHeader*)(pakBytes + record->localFileHeaderOffset);
+    auto fname = (char*)pakBytes+record->localFileHeaderOffset+sizeof(LocalFileHeader);
+
+    unsigned long compressedLen = localHeader->compressedSize;
+    u8* compressedBytes = (u8*)(pakBytes +
+        record->localFileHeaderOffset +
+        sizeof(LocalFileHeader) +
+        localHeader->fnameLength +
+        localHeader->extraFieldLength);
+    unsigned long uncompressedLen = localHeader->uncompressedSize;
+    auto result = (u8*)malloc(uncompressedLen);
+
+    if (localHeader->method == 0) {
+        // File is stored, no uncompression needed.
+        memcpy(result, compressedBytes, compressedLen);
+    } else if (localHeader->method == 8) {
+        // File is stored with DEFLATE.
+        auto errorCode = puff(
+            result, &uncompressedLen,
+            compressedBytes, &compressedLen
+        );
+        if (errorCode != 0) {
+            ERR("could not unpack '%.*s': %d", record->fnameLength, fname, errorCode);
+            free(result);
+            return nullptr;
+        }
+    } else {
+        ERR("unsupported compression method '%.*s': %d", record->fnameLength, fname, record->method);
+        free(result);
+        return nullptr;
+    }
+
+    // NOTE: puff has no way to hand out its output as it goes, so the CRC is
+    // taken right after inflating, while the file is still in cache.
+    u32 crc = updateCRC32(0, result, uncompressedLen);
+    if (crc != record->crc) {
+        ERR(
+            "CRC mismatch in '%.*s': %08x, expected %08x",
+            record->fnameLength, fname,
+            crc,
+            record->crc
+        );
+        free(result);
+        return nullptr;
+    }
+
+    if (uncompressedLength) {
+        *uncompressedLength = uncompressedLen;
+    }
+    return result;
+}
+
+// Unpacks and checks the CRC of every entry in the PAK on pool, then measures
+// CRC throughput over the whole PAK file. Returns false if any entry is bad.
+bool
+verifyPAK(
+    PAK& pak,
+    WorkerPool& pool
+) {
+    CDRecord** records = NULL;
+    char* ptr = pak.bytes + pak.eocd->cdrOffset;
+    for (u16 index = 0; index < pak.eocd->cdrCount; index++) {
+        auto record = (CDRecord*)ptr;
+        char* fname = ptr + sizeof(CDRecord);
+        bool directory = record->fnameLength > 0 && fname[record->fnameLength - 1] == '/';
+        if (!directory) {
+            arrput(records, record);
+        }
+        ptr += sizeof(CDRecord);
+        ptr += record->fnameLength;
+        ptr += record->extraFieldLength;
+        ptr += record->fileCommentLength;
+    }
+
+    std::atomic<u32> failures{0};
+    std::atomic<u64> bytes{0};
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    parallelFor(pool, (u32)arrlenu(records), [&](u32 i) {
+        u32 length = 0;
+        u8* data = unpackFile(pak.bytes, records[i], &length);
+        if (data == nullptr) {
+            failures++;
+            return;
+        }
+        bytes += length;
+        free(data);
+    });
+    QueryPerformanceCounter(&end);
+    double seconds = (double)(end.QuadPart - start.QuadPart) / counterFrequency.QuadPart;
+    INFO(
+        "Verified %u entries (%.1f MB) on %u threads in %.3f s: %u bad",
+        (u32)arrlenu(records),
+        bytes.load() / (1024.0 * 1024.0),
+        getWorkerCount(pool),
+        seconds,
+        failures.load()
+    );
+    arrfree(records);
+
+    // CRC throughput on its own, over the raw PAK.
+    auto measure = [&](const char* name, u32 (*function)(u32, const u8*, u64)) {
+        // NOTE: The PCLMULQDQ path takes whole 16 byte blocks only.
+        u64 length = pak.size & ~(u64)15;
+        LARGE_INTEGER crcStart, crcEnd;
+        QueryPerformanceCounter(&crcStart);
+        u32 crc = ~function(~0u, (u8*)pak.bytes, length);
+        QueryPerformanceCounter(&crcEnd);
+        double crcSeconds = (double)(crcEnd.QuadPart - crcStart.QuadPart) / counterFrequency.QuadPart;
+        INFO(
+            "%s: %.2f GB/s (%08x)",
+            name,
+            length / crcSeconds / (1024.0 * 1024.0 * 1024.0),
+            crc
+        );
+    };
+    measure("CRC-32 slice-by-8", crc32SliceBy8);
+    if (hasPCLMUL()) {
+        measure("CRC-32 PCLMULQDQ", crc32PCLMUL);
+    } else {
+        INFO("CRC-32 PCLMULQDQ: not supported by this CPU");
+    }
+
+    return failures.load() == 0;
+}
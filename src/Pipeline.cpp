@@ -0,0 +1,557 @@
+#include "SPIRV-Reflect/spirv_reflect.h"
+
+// NOTE: Pipelines are created here rather than through initVKPipeline so that
+// descriptor sets can be allocated separately from the pipeline. Each loaded
+// map owns its own descriptor pool, which lets a new map's sets be written
+// while the old map's sets are still referenced by in-flight frames.
+struct Pipeline {
+    VkPipeline handle;
+    VkPipelineLayout layout;
+    VkDescriptorSetLayout descriptorLayout;
+    VkDescriptorPoolSize* poolSizes;
+};
+
+u8*
+readShaderFile(
+    const char* path,
+    u32& size
+) {
+    struct _stat stat = {};
+    if (_stat(path, &stat) != 0) {
+        FATAL("could not stat shader '%s'", path);
+    }
+
+    FILE* file;
+    if (fopen_s(&file, path, "rb") != 0) {
+        FATAL("could not open shader '%s'", path);
+    }
+
+    auto bytes = (u8*)malloc(stat.st_size);
+    size = (u32)fread(bytes, 1, stat.st_size, file);
+    fclose(file);
+    LERROR(size != stat.st_size);
+    return bytes;
+}
+
+u32
+getFormatSize(
+    VkFormat format
+) {
+    switch (format) {
+        case VK_FORMAT_R32_UINT:
+        case VK_FORMAT_R32_SINT:
+        case VK_FORMAT_R32_SFLOAT:
+            return 4;
+        case VK_FORMAT_R32G32_UINT:
+        case VK_FORMAT_R32G32_SINT:
+        case VK_FORMAT_R32G32_SFLOAT:
+            return 8;
+        case VK_FORMAT_R32G32B32_UINT:
+        case VK_FORMAT_R32G32B32_SINT:
+        case VK_FORMAT_R32G32B32_SFLOAT:
+            return 12;
+        case VK_FORMAT_R32G32B32A32_UINT:
+        case VK_FORMAT_R32G32B32A32_SINT:
+        case VK_FORMAT_R32G32B32A32_SFLOAT:
+            return 16;
+        default:
+            FATAL("unsupported vertex input format: %d", format);
+    }
+    return 0;
+}
+
+struct ShaderStage {
+    VkShaderModule module;
+    SpvReflectShaderModule reflection;
+    VkShaderStageFlagBits stage;
+};
+
+void
+loadShaderStage(
+    Vulkan& vk,
+    const char* name,
+    const char* extension,
+    VkShaderStageFlagBits stageFlag,
+    ShaderStage& stage
+) {
+    char path[MAX_PATH];
+    sprintf_s(path, "shaders/%s.%s.spv", name, extension);
+
+    u32 size = 0;
+    u8* code = readShaderFile(path, size);
+    trackPipelineMemory(size);
+
+    auto result = spvReflectCreateShaderModule(size, code, &stage.reflection);
+    if (result != SPV_REFLECT_RESULT_SUCCESS) {
+        FATAL("could not reflect shader '%s': %d", path, result);
+    }
+
+    VkShaderModuleCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    createInfo.codeSize = size;
+    createInfo.pCode = (u32*)code;
+    VKCHECK(vkCreateShaderModule(vk.device, &createInfo, nullptr, &stage.module));
+
+    stage.stage = stageFlag;
+    free(code);
+    trackPipelineMemory(-(i64)size);
+}
+
+void
+createPipeline(
+    Vulkan& vk,
+    VkPipelineCache cache,
+    const char* name,
+    Pipeline& pipeline
+) {
+    ShaderStage stages[2] = {};
+    loadShaderStage(vk, name, "vert", VK_SHADER_STAGE_VERTEX_BIT, stages[0]);
+    loadShaderStage(vk, name, "frag", VK_SHADER_STAGE_FRAGMENT_BIT, stages[1]);
+    const u32 stageCount = sizeof(stages) / sizeof(ShaderStage);
+
+    // Descriptor bindings are merged across stages by binding number.
+    VkDescriptorSetLayoutBinding* bindings = NULL;
+    VkPushConstantRange* pushRanges = NULL;
+    for (u32 stageIdx = 0; stageIdx < stageCount; stageIdx++) {
+        auto& stage = stages[stageIdx];
+
+        u32 bindingCount = 0;
+        spvReflectEnumerateDescriptorBindings(&stage.reflection, &bindingCount, nullptr);
+        SpvReflectDescriptorBinding** reflected = NULL;
+        arrsetlen(reflected, bindingCount);
+        spvReflectEnumerateDescriptorBindings(&stage.reflection, &bindingCount, reflected);
+        for (u32 i = 0; i < bindingCount; i++) {
+            auto& r = *reflected[i];
+            VkDescriptorSetLayoutBinding* binding = nullptr;
+            for (int j = 0; j < arrlen(bindings); j++) {
+                if (bindings[j].binding == r.binding) {
+                    binding = &bindings[j];
+                }
+            }
+            if (binding == nullptr) {
+                binding = arraddnptr(bindings, 1);
+                *binding = {};
+                binding->binding = r.binding;
+                binding->descriptorType = (VkDescriptorType)r.descriptor_type;
+                binding->descriptorCount = r.count;
+            }
+            binding->stageFlags |= stage.stage;
+        }
+        arrfree(reflected);
+
+        u32 blockCount = 0;
+        spvReflectEnumeratePushConstantBlocks(&stage.reflection, &blockCount, nullptr);
+        SpvReflectBlockVariable** blocks = NULL;
+        arrsetlen(blocks, blockCount);
+        spvReflectEnumeratePushConstantBlocks(&stage.reflection, &blockCount, blocks);
+        for (u32 i = 0; i < blockCount; i++) {
+            VkPushConstantRange range = {};
+            range.stageFlags = stage.stage;
+            range.offset = blocks[i]->offset;
+            range.size = blocks[i]->size;
+            arrput(pushRanges, range);
+        }
+        arrfree(blocks);
+    }
+
+    pipeline.poolSizes = NULL;
+    for (int i = 0; i < arrlen(bindings); i++) {
+        VkDescriptorPoolSize poolSize = {};
+        poolSize.type = bindings[i].descriptorType;
+        poolSize.descriptorCount = bindings[i].descriptorCount;
+        arrput(pipeline.poolSizes, poolSize);
+    }
+
+    {
+        VkDescriptorSetLayoutCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        createInfo.bindingCount = (u32)arrlenu(bindings);
+        createInfo.pBindings = bindings;
+        VKCHECK(vkCreateDescriptorSetLayout(
+            vk.device,
+            &createInfo,
+            nullptr,
+            &pipeline.descriptorLayout
+        ));
+    }
+
+    {
+        VkPipelineLayoutCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        createInfo.setLayoutCount = 1;
+        createInfo.pSetLayouts = &pipeline.descriptorLayout;
+        createInfo.pushConstantRangeCount = (u32)arrlenu(pushRanges);
+        createInfo.pPushConstantRanges = pushRanges;
+        VKCHECK(vkCreatePipelineLayout(
+            vk.device,
+            &createInfo,
+            nullptr,
+            &pipeline.layout
+        ));
+    }
+
+    // Vertex inputs are packed in location order into a single binding.
+    VkVertexInputAttributeDescription* attributes = NULL;
+    u32 stride = 0;
+    {
+        auto& vertStage = stages[0];
+        u32 inputCount = 0;
+        spvReflectEnumerateInputVariables(&vertStage.reflection, &inputCount, nullptr);
+        SpvReflectInterfaceVariable** inputs = NULL;
+        arrsetlen(inputs, inputCount);
+        spvReflectEnumerateInputVariables(&vertStage.reflection, &inputCount, inputs);
+        for (u32 i = 0; i < inputCount; i++) {
+            auto& input = *inputs[i];
+            if (input.decoration_flags & SPV_REFLECT_DECORATION_BUILT_IN) {
+                continue;
+            }
+            VkVertexInputAttributeDescription attribute = {};
+            attribute.binding = 0;
+            attribute.location = input.location;
+            attribute.format = (VkFormat)input.format;
+            arrput(attributes, attribute);
+        }
+        arrfree(inputs);
+
+        // Reflection does not report inputs in location order.
+        auto attributeCount = arrlen(attributes);
+        for (int i = 1; i < attributeCount; i++) {
+            for (int j = i; j > 0 && attributes[j - 1].location > attributes[j].location; j--) {
+                auto swap = attributes[j];
+                attributes[j] = attributes[j - 1];
+                attributes[j - 1] = swap;
+            }
+        }
+        for (int i = 0; i < attributeCount; i++) {
+            attributes[i].offset = stride;
+            stride += getFormatSize(attributes[i].format);
+        }
+    }
+
+    VkVertexInputBindingDescription vertexBinding = {};
+    vertexBinding.binding = 0;
+    vertexBinding.stride = stride;
+    vertexBinding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+    VkPipelineVertexInputStateCreateInfo vertexInput = {};
+    vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInput.vertexBindingDescriptionCount = 1;
+    vertexInput.pVertexBindingDescriptions = &vertexBinding;
+    vertexInput.vertexAttributeDescriptionCount = (u32)arrlenu(attributes);
+    vertexInput.pVertexAttributeDescriptions = attributes;
+
+    VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
+    inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    VkViewport viewport = {};
+    viewport.width = (float)vk.swap.extent.width;
+    viewport.height = (float)vk.swap.extent.height;
+    viewport.minDepth = 0.f;
+    viewport.maxDepth = 1.f;
+
+    VkRect2D scissor = {};
+    scissor.extent = vk.swap.extent;
+
+    VkPipelineViewportStateCreateInfo viewportState = {};
+    viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewportState.viewportCount = 1;
+    viewportState.pViewports = &viewport;
+    viewportState.scissorCount = 1;
+    viewportState.pScissors = &scissor;
+
+    VkPipelineRasterizationStateCreateInfo rasterization = {};
+    rasterization.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterization.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterization.cullMode = VK_CULL_MODE_NONE;
+    rasterization.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    rasterization.lineWidth = 1.f;
+
+    VkPipelineMultisampleStateCreateInfo multisample = {};
+    multisample.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisample.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    VkPipelineDepthStencilStateCreateInfo depthStencil = {};
+    depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil.depthTestEnable = VK_TRUE;
+    depthStencil.depthWriteEnable = VK_TRUE;
+    depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+
+    VkPipelineColorBlendAttachmentState blendAttachment = {};
+    blendAttachment.colorWriteMask =
+        VK_COLOR_COMPONENT_R_BIT |
+        VK_COLOR_COMPONENT_G_BIT |
+        VK_COLOR_COMPONENT_B_BIT |
+        VK_COLOR_COMPONENT_A_BIT;
+
+    VkPipelineColorBlendStateCreateInfo colorBlend = {};
+    colorBlend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlend.attachmentCount = 1;
+    colorBlend.pAttachments = &blendAttachment;
+
+    VkPipelineShaderStageCreateInfo stageInfos[stageCount] = {};
+    for (u32 i = 0; i < stageCount; i++) {
+        stageInfos[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        stageInfos[i].stage = stages[i].stage;
+        stageInfos[i].module = stages[i].module;
+        stageInfos[i].pName = "main";
+    }
+
+    VkGraphicsPipelineCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    createInfo.stageCount = stageCount;
+    createInfo.pStages = stageInfos;
+    createInfo.pVertexInputState = &vertexInput;
+    createInfo.pInputAssemblyState = &inputAssembly;
+    createInfo.pViewportState = &viewportState;
+    createInfo.pRasterizationState = &rasterization;
+    createInfo.pMultisampleState = &multisample;
+    createInfo.pDepthStencilState = &depthStencil;
+    createInfo.pColorBlendState = &colorBlend;
+    createInfo.layout = pipeline.layout;
+    createInfo.renderPass = vk.renderPass;
+    createInfo.subpass = 0;
+    VKCHECK(vkCreateGraphicsPipelines(
+        vk.device,
+        cache,
+        1,
+        &createInfo,
+        nullptr,
+        &pipeline.handle
+    ));
+
+    for (u32 i = 0; i < stageCount; i++) {
+        vkDestroyShaderModule(vk.device, stages[i].module, nullptr);
+        spvReflectDestroyShaderModule(&stages[i].reflection);
+    }
+    arrfree(attributes);
+    arrfree(pushRanges);
+    arrfree(bindings);
+}
+
+// Creates every named pipeline in parallel on pool. The cache is internally
+// synchronized so all threads can share it.
+void
+createPipelines(
+    Vulkan& vk,
+    WorkerPool& pool,
+    VkPipelineCache cache,
+    const char** names,
+    Pipeline* pipelines,
+    u32 count
+) {
+    parallelFor(pool, count, [&](u32 i) {
+        createPipeline(vk, cache, names[i], pipelines[i]);
+    });
+}
+
+void
+destroyPipeline(
+    Vulkan& vk,
+    Pipeline& pipeline
+) {
+    vkDestroyPipeline(vk.device, pipeline.handle, nullptr);
+    vkDestroyPipelineLayout(vk.device, pipeline.layout, nullptr);
+    vkDestroyDescriptorSetLayout(vk.device, pipeline.descriptorLayout, nullptr);
+    arrfree(pipeline.poolSizes);
+}
+
+// Creates a pool large enough for setsPerPipeline descriptor sets of every
+// pipeline in the list.
+VkDescriptorPool
+createDescriptorPool(
+    Vulkan& vk,
+    Pipeline* pipelines,
+    u32 pipelineCount,
+    u32 setsPerPipeline
+) {
+    VkDescriptorPoolSize* sizes = NULL;
+    for (u32 i = 0; i < pipelineCount; i++) {
+        auto& pipeline = pipelines[i];
+        for (int j = 0; j < arrlen(pipeline.poolSizes); j++) {
+            auto size = pipeline.poolSizes[j];
+            size.descriptorCount *= setsPerPipeline;
+            arrput(sizes, size);
+        }
+    }
+
+    VkDescriptorPoolCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    createInfo.maxSets = pipelineCount * setsPerPipeline;
+    createInfo.poolSizeCount = (u32)arrlenu(sizes);
+    createInfo.pPoolSizes = sizes;
+
+    VkDescriptorPool pool;
+    VKCHECK(vkCreateDescriptorPool(vk.device, &createInfo, nullptr, &pool));
+    arrfree(sizes);
+    return pool;
+}
+
+VkDescriptorSet
+allocateDescriptorSet(
+    Vulkan& vk,
+    VkDescriptorPool pool,
+    Pipeline& pipeline
+) {
+    VkDescriptorSetAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocateInfo.descriptorPool = pool;
+    allocateInfo.descriptorSetCount = 1;
+    allocateInfo.pSetLayouts = &pipeline.descriptorLayout;
+
+    VkDescriptorSet set;
+    VKCHECK(vkAllocateDescriptorSets(vk.device, &allocateInfo, &set));
+    return set;
+}
+
+// NOTE: The driver validates its own header inside the cache data, but not
+// every driver rejects data from an older build of itself. This header is
+// checked first so stale caches are thrown away rather than handed over.
+const char PIPELINE_CACHE_MAGIC[4] = { 'K', 'W', 'P', 'C' };
+const u32 PIPELINE_CACHE_VERSION = 2;
+
+// Written to disk as is, so every field has a fixed size and the layout has
+// no padding.
+struct PipelineCacheHeader {
+    char magic[4];
+    u32 version;
+    u32 vendorID;
+    u32 deviceID;
+    u32 driverVersion;
+    u32 reserved;
+    u8 uuid[VK_UUID_SIZE];
+    u64 dataSize;
+    u64 dataHash;
+};
+static_assert(sizeof(PipelineCacheHeader) == 56, "PipelineCacheHeader must not be padded");
+
+u64
+hashPipelineCacheData(
+    u8* data,
+    u64 size
+) {
+    // FNV-1a, only used to catch truncated or corrupted files.
+    u64 hash = 14695981039346656037ull;
+    for (u64 i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void
+initPipelineCacheHeader(
+    Vulkan& vk,
+    PipelineCacheHeader& header
+) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk.gpu, &properties);
+    header = {};
+    memcpy(header.magic, PIPELINE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = PIPELINE_CACHE_VERSION;
+    header.vendorID = properties.vendorID;
+    header.deviceID = properties.deviceID;
+    header.driverVersion = properties.driverVersion;
+    memcpy(header.uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+// Reads the cache data from disk if it was written by this device and driver.
+// Returns nullptr when there is no usable cache.
+u8*
+readPipelineCacheFile(
+    Vulkan& vk,
+    const char* path,
+    u64& dataSize
+) {
+    struct _stat stat = {};
+    FILE* file;
+    if (_stat(path, &stat) != 0 || fopen_s(&file, path, "rb") != 0) {
+        INFO("no pipeline cache at '%s'", path);
+        return nullptr;
+    }
+
+    PipelineCacheHeader expected;
+    initPipelineCacheHeader(vk, expected);
+
+    PipelineCacheHeader header = {};
+    u8* data = nullptr;
+    if (fread(&header, sizeof(header), 1, file) != 1) {
+        ERR("pipeline cache '%s' is truncated", path);
+    } else if (memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+               header.version != expected.version) {
+        ERR("pipeline cache '%s' has an unknown format", path);
+    } else if (header.vendorID != expected.vendorID ||
+               header.deviceID != expected.deviceID ||
+               header.driverVersion != expected.driverVersion ||
+               memcmp(header.uuid, expected.uuid, VK_UUID_SIZE) != 0) {
+        INFO("pipeline cache '%s' is from a different device or driver", path);
+    } else if (header.dataSize != (u64)stat.st_size - sizeof(header)) {
+        ERR("pipeline cache '%s' is truncated", path);
+    } else {
+        data = (u8*)malloc(header.dataSize);
+        if (fread(data, 1, header.dataSize, file) != header.dataSize ||
+            hashPipelineCacheData(data, header.dataSize) != header.dataHash) {
+            ERR("pipeline cache '%s' is corrupt", path);
+            free(data);
+            data = nullptr;
+        } else {
+            dataSize = header.dataSize;
+        }
+    }
+    fclose(file);
+    return data;
+}
+
+VkPipelineCache
+loadPipelineCache(
+    Vulkan& vk,
+    const char* path,
+    bool& warm
+) {
+    u64 dataSize = 0;
+    u8* data = readPipelineCacheFile(vk, path, dataSize);
+    warm = data != nullptr;
+    trackPipelineMemory(dataSize);
+
+    VkPipelineCacheCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    createInfo.initialDataSize = (size_t)dataSize;
+    createInfo.pInitialData = data;
+
+    VkPipelineCache cache;
+    VKCHECK(vkCreatePipelineCache(vk.device, &createInfo, nullptr, &cache));
+    free(data);
+    trackPipelineMemory(-(i64)dataSize);
+    if (warm) {
+        INFO("pipeline cache loaded from '%s' (%llu bytes)", path, dataSize);
+    }
+    return cache;
+}
+
+void
+savePipelineCache(
+    Vulkan& vk,
+    VkPipelineCache cache,
+    const char* path
+) {
+    size_t dataSize = 0;
+    VKCHECK(vkGetPipelineCacheData(vk.device, cache, &dataSize, nullptr));
+    auto data = (u8*)malloc(dataSize);
+    VKCHECK(vkGetPipelineCacheData(vk.device, cache, &dataSize, data));
+
+    PipelineCacheHeader header;
+    initPipelineCacheHeader(vk, header);
+    header.dataSize = dataSize;
+    header.dataHash = hashPipelineCacheData(data, dataSize);
+
+    FILE* file;
+    if (fopen_s(&file, path, "wb") != 0) {
+        ERR("could not write pipeline cache '%s'", path);
+    } else {
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(data, 1, dataSize, file);
+        fclose(file);
+        INFO("pipeline cache saved to '%s' (%zu bytes)", path, dataSize);
+    }
+    free(data);
+}
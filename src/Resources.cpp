@@ -0,0 +1,194 @@
+// NOTE: Memory accounting. Bytes held on the CPU heap and in Vulkan device
+// memory are tallied per category into a MemoryUsage, along with the most
+// ever held at once. Each map has its own; sharedMemory covers what all maps
+// use. Tracking is safe from any thread, and a null usage tracks nothing.
+enum MemoryCategory {
+    MEMORY_ARCHIVE,
+    MEMORY_TEXTURES,
+    MEMORY_LIGHTMAPS,
+    MEMORY_GEOMETRY,
+    MEMORY_STAGING,
+    MEMORY_CATEGORY_COUNT,
+};
+
+const char* memoryCategoryNames[MEMORY_CATEGORY_COUNT] = {
+    "archive",
+    "textures",
+    "lightmaps",
+    "geometry",
+    "staging",
+};
+
+struct MemoryUsage {
+    std::atomic<i64> heap[MEMORY_CATEGORY_COUNT];
+    std::atomic<i64> heapPeak[MEMORY_CATEGORY_COUNT];
+    std::atomic<i64> heapTotal;
+    std::atomic<i64> heapTotalPeak;
+    std::atomic<i64> device[MEMORY_CATEGORY_COUNT];
+    std::atomic<i64> devicePeak[MEMORY_CATEGORY_COUNT];
+    std::atomic<i64> deviceTotal;
+    std::atomic<i64> deviceTotalPeak;
+};
+
+MemoryUsage sharedMemory;
+
+// NOTE: Shader code and pipeline cache data are only held while pipelines
+// are being created, so they would read 0 in every snapshot. They are kept
+// out of the categories and only their peak is reported.
+std::atomic<i64> pipelineHeap;
+std::atomic<i64> pipelineHeapPeak;
+
+// What a MemoryUsage held at one point.
+struct MemorySnapshot {
+    i64 heap[MEMORY_CATEGORY_COUNT];
+    i64 device[MEMORY_CATEGORY_COUNT];
+};
+
+void
+raiseMemoryPeak(
+    std::atomic<i64>& peak,
+    i64 value
+) {
+    i64 current = peak.load();
+    while (value > current && !peak.compare_exchange_weak(current, value)) {}
+}
+
+// Adds bytes, negative when released.
+void
+trackHeapMemory(
+    MemoryUsage* usage,
+    MemoryCategory category,
+    i64 bytes
+) {
+    if (usage == nullptr) return;
+    raiseMemoryPeak(usage->heapPeak[category], usage->heap[category] += bytes);
+    raiseMemoryPeak(usage->heapTotalPeak, usage->heapTotal += bytes);
+}
+
+void
+trackDeviceMemory(
+    MemoryUsage* usage,
+    MemoryCategory category,
+    i64 bytes
+) {
+    if (usage == nullptr) return;
+    raiseMemoryPeak(usage->devicePeak[category], usage->device[category] += bytes);
+    raiseMemoryPeak(usage->deviceTotalPeak, usage->deviceTotal += bytes);
+}
+
+void
+trackPipelineMemory(
+    i64 bytes
+) {
+    raiseMemoryPeak(pipelineHeapPeak, pipelineHeap += bytes);
+}
+
+void
+takeMemorySnapshot(
+    MemoryUsage& usage,
+    MemorySnapshot& snapshot
+) {
+    for (u32 i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+        snapshot.heap[i] = usage.heap[i].load();
+        snapshot.device[i] = usage.device[i].load();
+    }
+}
+
+VkDeviceSize
+getBufferMemorySize(
+    Vulkan& vk,
+    VulkanBuffer& buffer
+) {
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(vk.device, buffer.handle, &requirements);
+    return requirements.size;
+}
+
+VkDeviceSize
+getImageMemorySize(
+    Vulkan& vk,
+    VulkanImage& image
+) {
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(vk.device, image.handle, &requirements);
+    return requirements.size;
+}
+
+u32
+findMemoryType(
+    VkPhysicalDeviceMemoryProperties& memories,
+    u32 typeBits,
+    VkMemoryPropertyFlags flags
+) {
+    for (u32 i = 0; i < memories.memoryTypeCount; i++) {
+        if ((typeBits & (1 << i)) &&
+            ((memories.memoryTypes[i].propertyFlags & flags) == flags)) {
+            return i;
+        }
+    }
+    FATAL("no memory type with flags %x", flags);
+    return 0;
+}
+
+void
+createBuffer(
+    Vulkan& vk,
+    VkDeviceSize size,
+    VkBufferUsageFlags usage,
+    VkMemoryPropertyFlags memoryFlags,
+    VulkanBuffer& buffer,
+    MemoryUsage* memory = nullptr,
+    MemoryCategory category = MEMORY_STAGING
+) {
+    VkBufferCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    createInfo.size = size;
+    createInfo.usage = usage;
+    createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VKCHECK(vkCreateBuffer(vk.device, &createInfo, nullptr, &buffer.handle));
+
+    VkMemoryRequirements requirements;
+    vkGetBufferMemoryRequirements(vk.device, buffer.handle, &requirements);
+
+    VkMemoryAllocateInfo allocateInfo = {};
+    allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocateInfo.allocationSize = requirements.size;
+    allocateInfo.memoryTypeIndex = findMemoryType(
+        vk.memories,
+        requirements.memoryTypeBits,
+        memoryFlags
+    );
+    VKCHECK(vkAllocateMemory(vk.device, &allocateInfo, nullptr, &buffer.memory));
+    VKCHECK(vkBindBufferMemory(vk.device, buffer.handle, buffer.memory, 0));
+    trackDeviceMemory(memory, category, requirements.size);
+}
+
+void
+destroyBuffer(
+    Vulkan& vk,
+    VulkanBuffer& buffer,
+    MemoryUsage* memory = nullptr,
+    MemoryCategory category = MEMORY_STAGING
+) {
+    if (memory != nullptr) {
+        trackDeviceMemory(memory, category, -(i64)getBufferMemorySize(vk, buffer));
+    }
+    vkDestroyBuffer(vk.device, buffer.handle, nullptr);
+    vkFreeMemory(vk.device, buffer.memory, nullptr);
+}
+
+void
+destroySampler(
+    Vulkan& vk,
+    VulkanSampler& sampler,
+    MemoryUsage* memory = nullptr,
+    MemoryCategory category = MEMORY_TEXTURES
+) {
+    if (memory != nullptr) {
+        trackDeviceMemory(memory, category, -(i64)getImageMemorySize(vk, sampler.image));
+    }
+    vkDestroySampler(vk.device, sampler.handle, nullptr);
+    vkDestroyImageView(vk.device, sampler.image.view, nullptr);
+    vkDestroyImage(vk.device, sampler.image.handle, nullptr);
+    vkFreeMemory(vk.device, sampler.image.memory, nullptr);
+}
@@ -0,0 +1,489 @@
+// NOTE: Map textures are streamed in as they become visible instead of being
+// loaded with the map. Every texture starts out bound to a shared placeholder.
+// The first time a face using it is drawn, it is queued for decoding in
+// background jobs, then uploaded without waiting on the GPU and swapped into
+// the map's sampler table. When resident textures would exceed the budget,
+// the ones that have gone unseen the longest are evicted.
+enum TextureResidency {
+    TEXTURE_UNLOADED,
+    // Queued for, or being, decoded by a streaming job.
+    TEXTURE_REQUESTED,
+    // Decoded, waiting for room in the budget.
+    TEXTURE_DECODED,
+    TEXTURE_UPLOADING,
+    TEXTURE_RESIDENT,
+    // Could not be decoded, shown with the missing texture placeholder.
+    TEXTURE_FAILED,
+};
+
+struct StreamedTexture {
+    const char* name;
+    CDRecord* record;
+    // Entry in the map's sampler table.
+    u32 slot;
+    TextureResidency residency;
+    u64 lastVisibleFrame;
+    ProcessedTexture decoded;
+    // Device memory the decoded texture will take once uploaded, 0 until
+    // it is first considered for upload.
+    VkDeviceSize memorySize;
+    VulkanSampler sampler;
+    TextureUpload upload;
+    // The map's memory accounting.
+    MemoryUsage* memory;
+};
+
+struct DecodedTexture {
+    StreamedTexture* texture;
+    bool succeeded;
+};
+
+// Evicted textures may still be sampled by frames in flight.
+struct RetiredSampler {
+    VulkanSampler sampler;
+    u64 frame;
+};
+
+struct StreamingStats {
+    i64 windowStart;
+    u32 requests;
+    u32 uploads;
+    u32 evictions;
+    u64 uploadedBytes;
+    // What the uploaded textures would take as uncompressed RGBA8.
+    u64 uploadedRGBABytes;
+    // Textures built by streaming jobs rather than read from the cache, and
+    // the time spent building their mips and encoding them.
+    u32 processed;
+    u32 cached;
+    u64 processedPixels;
+    i64 processTicks;
+};
+
+struct TextureStreamer {
+    PAK* pak;
+    WorkerPool* pool;
+    TextureSettings settings;
+    // Counts the streaming jobs.
+    JobCounter jobs;
+    u32 maxJobs;
+    std::mutex mutex;
+    std::condition_variable decodedOne;
+    // Shared with the streaming jobs, guarded by mutex.
+    StreamedTexture** queue;
+    StreamedTexture** decoding;
+    DecodedTexture* decoded;
+    u32 runningJobs;
+    // Render thread only.
+    DecodedTexture* pending;
+    u64 budget;
+    u64 residentBytes;
+    u64 uploadBytesPerFrame;
+    RetiredSampler* retired;
+    StreamingStats stats;
+};
+
+// Decodes one texture file and builds its mip chain, or reads the result of
+// doing so from the texture cache.
+bool
+loadTexture(
+    PAK& pak,
+    CDRecord* record,
+    const char* name,
+    TextureSettings& settings,
+    ProcessedTexture& texture
+) {
+    u32 fileLength = 0;
+    auto fileBytes = unpackFile(pak.bytes, record, &fileLength);
+    if (fileBytes == nullptr) {
+        return false;
+    }
+
+    u64 key = 0;
+    if (settings.cache) {
+        key = getTextureCacheKey(fileBytes, fileLength, settings);
+        if (readTextureCache(key, texture)) {
+            free(fileBytes);
+            return true;
+        }
+    }
+
+    // Baseline JPEGs take the fast path, everything else goes to stb_image.
+    int x, y, n;
+    u8* data = decodeJPEG(fileBytes, fileLength, x, y);
+    bool fromSTB = data == nullptr;
+    if (fromSTB) {
+        data = stbi_load_from_memory(
+            fileBytes, fileLength, &x, &y, &n, 4
+        );
+    }
+    free(fileBytes);
+    if (data == nullptr) {
+        ERR("could not load texture: '%s' (%s)", name, stbi_failure_reason());
+        return false;
+    }
+    processTexture(data, x, y, settings, texture);
+    if (fromSTB) {
+        stbi_image_free(data);
+    } else {
+        free(data);
+    }
+    if (settings.cache) {
+        writeTextureCache(key, texture);
+    }
+    return true;
+}
+
+// Decodes the oldest queued texture. Each job takes one texture and queues
+// the next job itself, so that the pool gets a chance to run other background
+// work in between.
+void
+streamingJob(
+    TextureStreamer& streamer
+) {
+    std::unique_lock<std::mutex> lock(streamer.mutex);
+    if (arrlen(streamer.queue) == 0) {
+        streamer.runningJobs--;
+        return;
+    }
+    auto texture = streamer.queue[0];
+    arrdel(streamer.queue, 0);
+    arrput(streamer.decoding, texture);
+    lock.unlock();
+
+    bool succeeded = loadTexture(
+        *streamer.pak,
+        texture->record,
+        texture->name,
+        streamer.settings,
+        texture->decoded
+    );
+
+    if (succeeded) {
+        trackHeapMemory(texture->memory, MEMORY_TEXTURES, texture->decoded.size);
+    }
+
+    lock.lock();
+    for (int i = 0; i < arrlen(streamer.decoding); i++) {
+        if (streamer.decoding[i] == texture) {
+            arrdelswap(streamer.decoding, i);
+            break;
+        }
+    }
+    arrput(streamer.decoded, (DecodedTexture{ texture, succeeded }));
+    streamer.decodedOne.notify_all();
+    bool more = arrlen(streamer.queue) > 0;
+    if (!more) {
+        streamer.runningJobs--;
+    }
+    lock.unlock();
+    if (more) {
+        runBackgroundJob(*streamer.pool, [&streamer]() { streamingJob(streamer); }, &streamer.jobs);
+    }
+}
+
+void
+createTextureStreamer(
+    PAK& pak,
+    WorkerPool& pool,
+    TextureSettings& settings,
+    u64 budget,
+    TextureStreamer& streamer
+) {
+    streamer.pak = &pak;
+    streamer.pool = &pool;
+    streamer.settings = settings;
+    streamer.queue = NULL;
+    streamer.decoding = NULL;
+    streamer.decoded = NULL;
+    streamer.runningJobs = 0;
+    streamer.pending = NULL;
+    streamer.budget = budget;
+    streamer.residentBytes = 0;
+    streamer.uploadBytesPerFrame = 8 * 1024 * 1024;
+    streamer.retired = NULL;
+    streamer.stats = {};
+
+    // NOTE: Leave half the pool to per-frame work and map loading.
+    streamer.maxJobs = getWorkerCount(pool) / 2;
+    if (streamer.maxJobs < 1) streamer.maxJobs = 1;
+    INFO(
+        "Streaming textures in up to %u jobs, %.0f MB budget",
+        streamer.maxJobs,
+        budget / (1024.0 * 1024.0)
+    );
+}
+
+// Must only be called once every map has been destroyed and the device is
+// idle.
+void
+destroyTextureStreamer(
+    Vulkan& vk,
+    TextureStreamer& streamer
+) {
+    waitForCounter(*streamer.pool, streamer.jobs);
+    for (int i = 0; i < arrlen(streamer.retired); i++) {
+        destroySampler(vk, streamer.retired[i].sampler);
+    }
+    arrfree(streamer.retired);
+    arrfree(streamer.queue);
+    arrfree(streamer.decoding);
+    arrfree(streamer.decoded);
+    arrfree(streamer.pending);
+}
+
+void
+requestTexture(
+    TextureStreamer& streamer,
+    StreamedTexture& texture
+) {
+    texture.residency = TEXTURE_REQUESTED;
+    texture.memorySize = 0;
+    bool startJob = false;
+    {
+        std::lock_guard<std::mutex> lock(streamer.mutex);
+        arrput(streamer.queue, &texture);
+        if (streamer.runningJobs < streamer.maxJobs) {
+            streamer.runningJobs++;
+            startJob = true;
+        }
+    }
+    if (startJob) {
+        runBackgroundJob(*streamer.pool, [&streamer]() { streamingJob(streamer); }, &streamer.jobs);
+    }
+    streamer.stats.requests++;
+}
+
+// Drops every request for textures, waiting for any that are being decoded.
+// Decoded data is left in the textures for the caller to free.
+void
+cancelTextureRequests(
+    TextureStreamer& streamer,
+    StreamedTexture* textures,
+    u32 count
+) {
+    auto inSet = [&](StreamedTexture* texture) {
+        return texture >= textures && texture < textures + count;
+    };
+
+    std::unique_lock<std::mutex> lock(streamer.mutex);
+    for (int i = 0; i < arrlen(streamer.queue); i++) {
+        if (inSet(streamer.queue[i])) {
+            arrdel(streamer.queue, i);
+            i--;
+        }
+    }
+    streamer.decodedOne.wait(lock, [&]() {
+        for (int i = 0; i < arrlen(streamer.decoding); i++) {
+            if (inSet(streamer.decoding[i])) return false;
+        }
+        return true;
+    });
+    for (int i = 0; i < arrlen(streamer.decoded); i++) {
+        if (inSet(streamer.decoded[i].texture)) {
+            arrdel(streamer.decoded, i);
+            i--;
+        }
+    }
+    lock.unlock();
+
+    for (int i = 0; i < arrlen(streamer.pending); i++) {
+        if (inSet(streamer.pending[i].texture)) {
+            arrdel(streamer.pending, i);
+            i--;
+        }
+    }
+}
+
+// Evicts the least recently visible resident textures that were not visible
+// this frame until need more bytes fit in the budget. Returns false if they
+// can not be made to fit.
+bool
+makeTextureRoom(
+    TextureStreamer& streamer,
+    StreamedTexture* textures,
+    VulkanSampler* samplers,
+    VulkanSampler& placeholder,
+    u64 frame,
+    u64 need
+) {
+    while (streamer.residentBytes + need > streamer.budget) {
+        StreamedTexture* victim = nullptr;
+        for (int i = 0; i < arrlen(textures); i++) {
+            auto& texture = textures[i];
+            if (texture.residency != TEXTURE_RESIDENT) continue;
+            if (texture.lastVisibleFrame >= frame) continue;
+            if (victim == nullptr || texture.lastVisibleFrame < victim->lastVisibleFrame) {
+                victim = &texture;
+            }
+        }
+        if (victim == nullptr) return false;
+
+        samplers[victim->slot] = placeholder;
+        arrput(streamer.retired, (RetiredSampler{ victim->sampler, frame }));
+        streamer.residentBytes -= victim->upload.memorySize;
+        trackDeviceMemory(victim->memory, MEMORY_TEXTURES, -(i64)victim->upload.memorySize);
+        victim->sampler = {};
+        victim->residency = TEXTURE_UNLOADED;
+        streamer.stats.evictions++;
+    }
+    return true;
+}
+
+// Moves streamed textures along for the current frame: finished uploads are
+// made visible in samplers, textures that could not be decoded are shown as
+// missing, decoded textures are uploaded as far as the budget
+// and the per-frame upload limit allow, and samplers of evicted textures are
+// destroyed once no frame in flight can use them. Returns true if samplers
+// changed.
+bool
+updateTextureStreaming(
+    Vulkan& vk,
+    TextureStreamer& streamer,
+    StreamedTexture* textures,
+    VulkanSampler* samplers,
+    VulkanSampler& placeholder,
+    VulkanSampler& missing,
+    FrameRing& frames
+) {
+    bool changed = false;
+    u32 count = (u32)arrlenu(textures);
+    auto inSet = [&](StreamedTexture* texture) {
+        return texture >= textures && texture < textures + count;
+    };
+
+    for (u32 i = 0; i < count; i++) {
+        auto& texture = textures[i];
+        if (texture.residency == TEXTURE_UPLOADING &&
+            finishTextureUpload(vk, texture.upload, false)) {
+            texture.residency = TEXTURE_RESIDENT;
+            samplers[texture.slot] = texture.sampler;
+            changed = true;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(streamer.mutex);
+        for (int i = 0; i < arrlen(streamer.decoded); i++) {
+            auto& decoded = streamer.decoded[i];
+            decoded.texture->residency = decoded.succeeded ? TEXTURE_DECODED : TEXTURE_FAILED;
+            if (decoded.succeeded) {
+                arrput(streamer.pending, decoded);
+                auto& processed = decoded.texture->decoded;
+                if (processed.fromCache) {
+                    streamer.stats.cached++;
+                } else {
+                    streamer.stats.processed++;
+                    streamer.stats.processedPixels += (u64)processed.width * processed.height;
+                    streamer.stats.processTicks += processed.processTicks;
+                }
+            }
+        }
+        arrsetlen(streamer.decoded, 0);
+    }
+
+    // NOTE: Checked here rather than when decode results are collected, as a
+    // result can come in while its map is not the current one.
+    for (u32 i = 0; i < count; i++) {
+        auto& texture = textures[i];
+        if (texture.residency == TEXTURE_FAILED &&
+            samplers[texture.slot].handle != missing.handle) {
+            samplers[texture.slot] = missing;
+            changed = true;
+        }
+    }
+
+    u64 uploaded = 0;
+    for (int i = 0; i < arrlen(streamer.pending) && uploaded < streamer.uploadBytesPerFrame; ) {
+        auto texture = streamer.pending[i].texture;
+        // NOTE: Textures of a map that is no longer current wait for their
+        // map to be destroyed.
+        if (!inSet(texture)) {
+            i++;
+            continue;
+        }
+        // NOTE: The budget is checked in the same aligned memory requirement
+        // size that residentBytes is charged, not the size of the data.
+        if (texture->memorySize == 0) {
+            texture->memorySize = getTextureMemorySize(vk, texture->decoded);
+        }
+        auto need = texture->memorySize;
+        u32 evictions = streamer.stats.evictions;
+        bool fits = makeTextureRoom(
+            streamer,
+            textures,
+            samplers,
+            placeholder,
+            frames.count,
+            need
+        );
+        changed |= streamer.stats.evictions != evictions;
+        if (!fits) {
+            i++;
+            continue;
+        }
+
+        beginTextureUpload(vk, texture->decoded, texture->sampler, texture->upload, texture->memory);
+        trackHeapMemory(texture->memory, MEMORY_TEXTURES, -(i64)texture->decoded.size);
+        free(texture->decoded.data);
+        texture->decoded.data = nullptr;
+        texture->residency = TEXTURE_UPLOADING;
+        streamer.residentBytes += texture->upload.memorySize;
+        uploaded += texture->decoded.size;
+        streamer.stats.uploads++;
+        streamer.stats.uploadedBytes += texture->decoded.size;
+        streamer.stats.uploadedRGBABytes += getRGBASize(texture->decoded);
+        arrdel(streamer.pending, i);
+    }
+
+    for (int i = 0; i < arrlen(streamer.retired); i++) {
+        if (frames.count - streamer.retired[i].frame >= frames.depth) {
+            destroySampler(vk, streamer.retired[i].sampler);
+            arrdelswap(streamer.retired, i);
+            i--;
+        }
+    }
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    auto& stats = streamer.stats;
+    if (stats.windowStart == 0) {
+        stats.windowStart = now.QuadPart;
+    }
+    if (now.QuadPart - stats.windowStart >= counterFrequency.QuadPart) {
+        double toMB = 1.0 / (1024 * 1024);
+        double seconds = (now.QuadPart - stats.windowStart) / (double)counterFrequency.QuadPart;
+        u32 queued;
+        {
+            std::lock_guard<std::mutex> lock(streamer.mutex);
+            queued = (u32)(arrlenu(streamer.queue) + arrlenu(streamer.decoding));
+        }
+        INFO(
+            "streaming: %.1f/%.0f MB resident, %.1f requests/s, %.1f uploads/s (%.1f MB/s), %.1f evictions/s, %u decoding, %u waiting for upload",
+            streamer.residentBytes * toMB,
+            streamer.budget * toMB,
+            stats.requests / seconds,
+            stats.uploads / seconds,
+            stats.uploadedBytes * toMB / seconds,
+            stats.evictions / seconds,
+            queued,
+            (u32)arrlenu(streamer.pending)
+        );
+        if (stats.processed + stats.cached + stats.uploads > 0) {
+            double processSeconds = stats.processTicks / (double)counterFrequency.QuadPart;
+            INFO(
+                "streaming: %u textures processed (%.1f MP/s per job), %u from cache, %.1f MB uploaded, %.1f MB as RGBA8 (%.1f MB saved)",
+                stats.processed,
+                processSeconds > 0 ? stats.processedPixels / processSeconds / 1e6 : 0.0,
+                stats.cached,
+                stats.uploadedBytes * toMB,
+                stats.uploadedRGBABytes * toMB,
+                ((i64)stats.uploadedRGBABytes - (i64)stats.uploadedBytes) * toMB
+            );
+        }
+        stats = {};
+        stats.windowStart = now.QuadPart;
+    }
+
+    return changed;
+}
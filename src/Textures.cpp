@@ -0,0 +1,1019 @@
+#include <emmintrin.h>
+#include <math.h>
+
+// NOTE: Textures are processed on the CPU after decoding: a full mip chain is
+// built in linear space (so that averaging does not darken sRGB texels) and
+// may then be block-compressed. Processed textures are cached on disk keyed
+// by the source file's contents and the settings used.
+enum MipFilter {
+    MIP_NONE,
+    MIP_BOX,
+    MIP_KAISER,
+};
+
+struct TextureSettings {
+    MipFilter mipFilter;
+    bool compress;
+    bool cache;
+};
+
+const u32 MAX_TEXTURE_LEVELS = 16;
+
+struct TextureLevel {
+    u32 width;
+    u32 height;
+    u64 offset;
+    u64 size;
+};
+
+struct ProcessedTexture {
+    VkFormat format;
+    u32 width;
+    u32 height;
+    u32 levelCount;
+    TextureLevel levels[MAX_TEXTURE_LEVELS];
+    u8* data;
+    u64 size;
+    // True if any texel is not fully opaque.
+    bool hasAlpha;
+    bool fromCache;
+    // Time spent building the mip chain and encoding it, 0 if from cache.
+    i64 processTicks;
+};
+
+float srgbToLinearTable[256];
+u8 linearToSRGBTable[4096];
+
+// Converts RGBA8 sRGB texels to linear float RGBA. Alpha is already linear.
+void
+rgbaToLinear(
+    u8* src,
+    u32 count,
+    float* dst
+) {
+    const float alphaScale = 1.f / 255.f;
+    for (u32 i = 0; i < count; i++) {
+        __m128 texel = _mm_setr_ps(
+            srgbToLinearTable[src[0]],
+            srgbToLinearTable[src[1]],
+            srgbToLinearTable[src[2]],
+            src[3] * alphaScale
+        );
+        _mm_storeu_ps(dst, texel);
+        src += 4;
+        dst += 4;
+    }
+}
+
+void
+linearToRGBA(
+    float* src,
+    u32 count,
+    u8* dst
+) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 scale = _mm_setr_ps(4095.f, 4095.f, 4095.f, 255.f);
+    const __m128 half = _mm_set1_ps(.5f);
+    for (u32 i = 0; i < count; i++) {
+        __m128 texel = _mm_loadu_ps(src);
+        texel = _mm_min_ps(_mm_max_ps(texel, zero), one);
+        __m128i indices = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(texel, scale), half));
+        alignas(16) i32 lanes[4];
+        _mm_store_si128((__m128i*)lanes, indices);
+        dst[0] = linearToSRGBTable[lanes[0]];
+        dst[1] = linearToSRGBTable[lanes[1]];
+        dst[2] = linearToSRGBTable[lanes[2]];
+        dst[3] = (u8)lanes[3];
+        src += 4;
+        dst += 4;
+    }
+}
+
+void
+downsampleBox(
+    float* src,
+    u32 width,
+    u32 height,
+    float* dst
+) {
+    u32 dstWidth = width > 1 ? width / 2 : 1;
+    u32 dstHeight = height > 1 ? height / 2 : 1;
+    const __m128 quarter = _mm_set1_ps(.25f);
+    for (u32 y = 0; y < dstHeight; y++) {
+        u32 y0 = y * 2;
+        u32 y1 = y0 + 1 < height ? y0 + 1 : y0;
+        float* row0 = src + y0 * width * 4;
+        float* row1 = src + y1 * width * 4;
+        for (u32 x = 0; x < dstWidth; x++) {
+            u32 x0 = x * 2;
+            u32 x1 = x0 + 1 < width ? x0 + 1 : x0;
+            __m128 sum = _mm_add_ps(
+                _mm_add_ps(_mm_loadu_ps(row0 + x0 * 4), _mm_loadu_ps(row0 + x1 * 4)),
+                _mm_add_ps(_mm_loadu_ps(row1 + x0 * 4), _mm_loadu_ps(row1 + x1 * 4))
+            );
+            _mm_storeu_ps(dst, _mm_mul_ps(sum, quarter));
+            dst += 4;
+        }
+    }
+}
+
+// 8-tap windowed sinc (Kaiser window, alpha 4) for halving an axis. Output
+// texel i is centred between input texels 2i and 2i+1.
+const int KAISER_TAPS = 8;
+float kaiserWeights[KAISER_TAPS];
+
+float
+besselI0(
+    float x
+) {
+    float sum = 1.f;
+    float term = 1.f;
+    for (int k = 1; k < 20; k++) {
+        term *= (x / (2.f * k)) * (x / (2.f * k));
+        sum += term;
+    }
+    return sum;
+}
+
+void
+initKaiserWeights() {
+    const float alpha = 4.f;
+    const float halfWidth = KAISER_TAPS / 4.f;
+    float total = 0;
+    for (int k = 0; k < KAISER_TAPS; k++) {
+        // Distance from the output texel centre, in output texels.
+        float d = (k - KAISER_TAPS / 2 + .5f) / 2.f;
+        float sinc = d == 0 ? 1.f : sinf(3.14159265f * d) / (3.14159265f * d);
+        float r = d / halfWidth;
+        float window = besselI0(alpha * sqrtf(fmaxf(0.f, 1.f - r * r))) / besselI0(alpha);
+        kaiserWeights[k] = sinc * window;
+        total += kaiserWeights[k];
+    }
+    for (int k = 0; k < KAISER_TAPS; k++) {
+        kaiserWeights[k] /= total;
+    }
+}
+
+// Halves one axis of the image with the Kaiser filter. Textures tile, so
+// samples outside the image wrap around. stride is the distance between
+// neighbouring texels along the filtered axis, lineStride between lines.
+void
+downsampleKaiserAxis(
+    float* src,
+    u32 length,
+    u32 lineCount,
+    u32 stride,
+    u32 lineStride,
+    float* dst,
+    u32 dstStride,
+    u32 dstLineStride
+) {
+    u32 dstLength = length / 2;
+    __m128 weights[KAISER_TAPS];
+    for (int k = 0; k < KAISER_TAPS; k++) {
+        weights[k] = _mm_set1_ps(kaiserWeights[k]);
+    }
+    for (u32 line = 0; line < lineCount; line++) {
+        float* in = src + line * lineStride * 4;
+        float* out = dst + line * dstLineStride * 4;
+        for (u32 i = 0; i < dstLength; i++) {
+            __m128 sum = _mm_setzero_ps();
+            i32 first = (i32)(i * 2) - KAISER_TAPS / 2 + 1;
+            if (first >= 0 && first + KAISER_TAPS <= (i32)length) {
+                float* tap = in + first * stride * 4;
+                for (int k = 0; k < KAISER_TAPS; k++) {
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(tap), weights[k]));
+                    tap += stride * 4;
+                }
+            } else {
+                for (int k = 0; k < KAISER_TAPS; k++) {
+                    i32 j = first + k;
+                    j = ((j % (i32)length) + (i32)length) % (i32)length;
+                    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(in + j * stride * 4), weights[k]));
+                }
+            }
+            _mm_storeu_ps(out + i * dstStride * 4, sum);
+        }
+    }
+}
+
+void
+downsampleKaiser(
+    float* src,
+    u32 width,
+    u32 height,
+    float* scratch,
+    float* dst
+) {
+    u32 dstWidth = width > 1 ? width / 2 : 1;
+    u32 dstHeight = height > 1 ? height / 2 : 1;
+
+    // Horizontal pass into scratch (dstWidth x height).
+    if (width > 1) {
+        downsampleKaiserAxis(src, width, height, 1, width, scratch, 1, dstWidth);
+    } else {
+        memcpy(scratch, src, height * 4 * sizeof(float));
+    }
+
+    // Vertical pass into dst (dstWidth x dstHeight).
+    if (height > 1) {
+        downsampleKaiserAxis(scratch, height, dstWidth, dstWidth, 1, dst, dstWidth, 1);
+    } else {
+        memcpy(dst, scratch, dstWidth * 4 * sizeof(float));
+    }
+}
+
+void
+initTextureTables() {
+    for (int i = 0; i < 256; i++) {
+        float c = i / 255.f;
+        srgbToLinearTable[i] = c <= 0.04045f
+            ? c / 12.92f
+            : powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+    for (int i = 0; i < 4096; i++) {
+        float l = i / 4095.f;
+        float c = l <= 0.0031308f
+            ? l * 12.92f
+            : 1.055f * powf(l, 1.f / 2.4f) - 0.055f;
+        linearToSRGBTable[i] = (u8)(c * 255.f + 0.5f);
+    }
+    initKaiserWeights();
+}
+
+u16
+packColor565(
+    u8* c
+) {
+    return (u16)(((c[0] * 31 + 127) / 255) << 11 |
+                 ((c[1] * 63 + 127) / 255) << 5 |
+                 ((c[2] * 31 + 127) / 255));
+}
+
+void
+unpackColor565(
+    u16 packed,
+    i32* c
+) {
+    i32 r = (packed >> 11) & 31;
+    i32 g = (packed >> 5) & 63;
+    i32 b = packed & 31;
+    c[0] = (r << 3) | (r >> 2);
+    c[1] = (g << 2) | (g >> 4);
+    c[2] = (b << 3) | (b >> 2);
+}
+
+// Encodes a 4x4 RGBA block as a BC1 colour block using the inset bounding box
+// of the block's colours, with the box diagonal picked from the sign of the
+// colour covariance. Always uses four-colour mode, so it is also valid as the
+// colour half of a BC3 block.
+void
+encodeBC1Block(
+    u8* block,
+    u8* out
+) {
+    // Bounding box, 16 texels in four registers.
+    __m128i t0 = _mm_loadu_si128((__m128i*)(block + 0));
+    __m128i t1 = _mm_loadu_si128((__m128i*)(block + 16));
+    __m128i t2 = _mm_loadu_si128((__m128i*)(block + 32));
+    __m128i t3 = _mm_loadu_si128((__m128i*)(block + 48));
+    __m128i mn = _mm_min_epu8(_mm_min_epu8(t0, t1), _mm_min_epu8(t2, t3));
+    __m128i mx = _mm_max_epu8(_mm_max_epu8(t0, t1), _mm_max_epu8(t2, t3));
+    mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 8));
+    mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 4));
+    mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 8));
+    mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 4));
+    u32 minPacked = (u32)_mm_cvtsi128_si32(mn);
+    u32 maxPacked = (u32)_mm_cvtsi128_si32(mx);
+
+    i32 lo[3], hi[3];
+    for (int c = 0; c < 3; c++) {
+        lo[c] = (minPacked >> (c * 8)) & 0xff;
+        hi[c] = (maxPacked >> (c * 8)) & 0xff;
+    }
+
+    // Pick the diagonal of the box that follows the colours.
+    i32 centre[3];
+    for (int c = 0; c < 3; c++) {
+        centre[c] = (lo[c] + hi[c]) / 2;
+    }
+    i32 covRG = 0, covBG = 0;
+    for (int i = 0; i < 16; i++) {
+        u8* p = block + i * 4;
+        i32 g = p[1] - centre[1];
+        covRG += (p[0] - centre[0]) * g;
+        covBG += (p[2] - centre[2]) * g;
+    }
+    if (covRG < 0) {
+        i32 swap = lo[0]; lo[0] = hi[0]; hi[0] = swap;
+    }
+    if (covBG < 0) {
+        i32 swap = lo[2]; lo[2] = hi[2]; hi[2] = swap;
+    }
+
+    // Inset the box by 1/16th to reduce the error at the endpoints.
+    u8 endpoints[2][3];
+    for (int c = 0; c < 3; c++) {
+        i32 inset = (hi[c] - lo[c]) / 16;
+        endpoints[0][c] = (u8)(hi[c] - inset);
+        endpoints[1][c] = (u8)(lo[c] + inset);
+    }
+    u16 c0 = packColor565(endpoints[0]);
+    u16 c1 = packColor565(endpoints[1]);
+
+    u32 indices = 0;
+    if (c0 != c1) {
+        if (c0 < c1) {
+            u16 swap = c0; c0 = c1; c1 = swap;
+        }
+        i32 palette[4][3];
+        unpackColor565(c0, palette[0]);
+        unpackColor565(c1, palette[1]);
+        for (int c = 0; c < 3; c++) {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        // Project each texel onto the endpoint axis and round to the nearest
+        // of the four palette entries along it.
+        i32 axis[3];
+        i32 axisLength = 0;
+        for (int c = 0; c < 3; c++) {
+            axis[c] = palette[0][c] - palette[1][c];
+            axisLength += axis[c] * axis[c];
+        }
+        // Palette positions along the axis from c1 to c0.
+        const u32 rampToIndex[4] = { 1, 3, 2, 0 };
+        for (int i = 0; i < 16; i++) {
+            u8* p = block + i * 4;
+            i32 dot = (p[0] - palette[1][0]) * axis[0] +
+                      (p[1] - palette[1][1]) * axis[1] +
+                      (p[2] - palette[1][2]) * axis[2];
+            i32 ramp = (dot * 6 + axisLength) / (axisLength * 2);
+            ramp = ramp < 0 ? 0 : ramp > 3 ? 3 : ramp;
+            indices |= rampToIndex[ramp] << (i * 2);
+        }
+    }
+
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    out[4] = indices & 0xff;
+    out[5] = (indices >> 8) & 0xff;
+    out[6] = (indices >> 16) & 0xff;
+    out[7] = indices >> 24;
+}
+
+// Encodes the alpha half of a BC3 block in eight-value mode.
+void
+encodeBC3AlphaBlock(
+    u8* block,
+    u8* out
+) {
+    i32 lo = 255, hi = 0;
+    for (int i = 0; i < 16; i++) {
+        i32 a = block[i * 4 + 3];
+        if (a < lo) lo = a;
+        if (a > hi) hi = a;
+    }
+
+    u64 indices = 0;
+    if (hi != lo) {
+        // Palette positions from hi to lo: hi, 6 interpolated values, lo.
+        const u64 rampToIndex[8] = { 0, 2, 3, 4, 5, 6, 7, 1 };
+        i32 range = hi - lo;
+        for (int i = 0; i < 16; i++) {
+            i32 a = block[i * 4 + 3];
+            i32 ramp = ((hi - a) * 14 + range) / (range * 2);
+            indices |= rampToIndex[ramp] << (i * 3);
+        }
+    }
+
+    out[0] = (u8)hi;
+    out[1] = (u8)lo;
+    for (int i = 0; i < 6; i++) {
+        out[2 + i] = (u8)(indices >> (i * 8));
+    }
+}
+
+// Gathers the 4x4 block at (bx, by), clamping at the image edges.
+void
+loadBlock(
+    u8* rgba,
+    u32 width,
+    u32 height,
+    u32 bx,
+    u32 by,
+    u8* block
+) {
+    for (u32 y = 0; y < 4; y++) {
+        u32 sy = by * 4 + y < height ? by * 4 + y : height - 1;
+        for (u32 x = 0; x < 4; x++) {
+            u32 sx = bx * 4 + x < width ? bx * 4 + x : width - 1;
+            memcpy(block + (y * 4 + x) * 4, rgba + (sy * width + sx) * 4, 4);
+        }
+    }
+}
+
+u64
+getLevelSize(
+    VkFormat format,
+    u32 width,
+    u32 height
+) {
+    u32 blocksX = (width + 3) / 4;
+    u32 blocksY = (height + 3) / 4;
+    switch (format) {
+        case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+            return (u64)blocksX * blocksY * 8;
+        case VK_FORMAT_BC3_UNORM_BLOCK:
+            return (u64)blocksX * blocksY * 16;
+        default:
+            return (u64)width * height * 4;
+    }
+}
+
+// Levels in a full mip chain down to 1x1, capped at MAX_TEXTURE_LEVELS.
+u32
+getFullLevelCount(
+    u32 width,
+    u32 height
+) {
+    u32 count = 1;
+    u32 size = width > height ? width : height;
+    while (size > 1 && count < MAX_TEXTURE_LEVELS) {
+        size /= 2;
+        count++;
+    }
+    return count;
+}
+
+// Fills in levels and size from the format, size and level count, with the
+// levels packed one after another.
+void
+layoutTextureLevels(
+    ProcessedTexture& texture
+) {
+    u32 levelWidth = texture.width;
+    u32 levelHeight = texture.height;
+    texture.size = 0;
+    for (u32 i = 0; i < texture.levelCount; i++) {
+        auto& level = texture.levels[i];
+        level.width = levelWidth;
+        level.height = levelHeight;
+        level.offset = texture.size;
+        level.size = getLevelSize(texture.format, levelWidth, levelHeight);
+        texture.size += level.size;
+        levelWidth = levelWidth > 1 ? levelWidth / 2 : 1;
+        levelHeight = levelHeight > 1 ? levelHeight / 2 : 1;
+    }
+}
+
+// Size of the texture's levels as uncompressed RGBA8.
+u64
+getRGBASize(
+    ProcessedTexture& texture
+) {
+    u64 size = 0;
+    for (u32 i = 0; i < texture.levelCount; i++) {
+        size += (u64)texture.levels[i].width * texture.levels[i].height * 4;
+    }
+    return size;
+}
+
+void
+encodeLevel(
+    VkFormat format,
+    u8* rgba,
+    u32 width,
+    u32 height,
+    u8* out
+) {
+    if (format == VK_FORMAT_R8G8B8A8_UNORM) {
+        memcpy(out, rgba, (u64)width * height * 4);
+        return;
+    }
+
+    alignas(16) u8 block[64];
+    u32 blocksX = (width + 3) / 4;
+    u32 blocksY = (height + 3) / 4;
+    for (u32 by = 0; by < blocksY; by++) {
+        for (u32 bx = 0; bx < blocksX; bx++) {
+            loadBlock(rgba, width, height, bx, by, block);
+            if (format == VK_FORMAT_BC3_UNORM_BLOCK) {
+                encodeBC3AlphaBlock(block, out);
+                out += 8;
+            }
+            encodeBC1Block(block, out);
+            out += 8;
+        }
+    }
+}
+
+// Builds the mip chain for an RGBA8 image and encodes every level in the
+// format picked by the settings. Does not take ownership of rgba.
+void
+processTexture(
+    u8* rgba,
+    u32 width,
+    u32 height,
+    TextureSettings& settings,
+    ProcessedTexture& result
+) {
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+
+    result = {};
+    result.width = width;
+    result.height = height;
+    result.format = VK_FORMAT_R8G8B8A8_UNORM;
+    u64 baseSize = (u64)width * height * 4;
+    for (u64 i = 3; i < baseSize; i += 4) {
+        if (rgba[i] != 0xff) {
+            result.hasAlpha = true;
+            break;
+        }
+    }
+    if (settings.compress) {
+        result.format = result.hasAlpha
+            ? VK_FORMAT_BC3_UNORM_BLOCK
+            : VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+    }
+
+    result.levelCount = settings.mipFilter != MIP_NONE
+        ? getFullLevelCount(width, height)
+        : 1;
+    layoutTextureLevels(result);
+    result.data = (u8*)malloc(result.size);
+
+    encodeLevel(result.format, rgba, width, height, result.data);
+
+    if (result.levelCount > 1) {
+        u64 texelCount = (u64)width * height;
+        auto linear = (float*)malloc(texelCount * 4 * sizeof(float));
+        auto next = (float*)malloc(texelCount * 4 * sizeof(float));
+        auto scratch = (float*)malloc(texelCount * 4 * sizeof(float));
+        auto levelRGBA = (u8*)malloc(texelCount * 4);
+        rgbaToLinear(rgba, (u32)texelCount, linear);
+
+        for (u32 i = 1; i < result.levelCount; i++) {
+            auto& previous = result.levels[i - 1];
+            auto& level = result.levels[i];
+            if (settings.mipFilter == MIP_KAISER) {
+                downsampleKaiser(linear, previous.width, previous.height, scratch, next);
+            } else {
+                downsampleBox(linear, previous.width, previous.height, next);
+            }
+            u32 count = level.width * level.height;
+            linearToRGBA(next, count, levelRGBA);
+            encodeLevel(result.format, levelRGBA, level.width, level.height, result.data + level.offset);
+            float* swap = linear;
+            linear = next;
+            next = swap;
+        }
+
+        free(levelRGBA);
+        free(scratch);
+        free(next);
+        free(linear);
+    }
+
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+    result.processTicks = end.QuadPart - start.QuadPart;
+}
+
+const char TEXTURE_CACHE_MAGIC[4] = { 'K', 'W', 'T', 'X' };
+const u32 TEXTURE_CACHE_VERSION = 3;
+const char* TEXTURE_CACHE_DIR = "texcache";
+// Larger than any texture processTexture will see, small enough that the
+// level sizes cannot overflow.
+const u32 MAX_CACHED_TEXTURE_SIZE = 16384;
+
+// Written to disk as is, so the layout has no padding.
+struct TextureCacheHeader {
+    char magic[4];
+    u32 version;
+    u32 format;
+    u32 width;
+    u32 height;
+    u32 levelCount;
+    u32 hasAlpha;
+    u32 reserved;
+    TextureLevel levels[MAX_TEXTURE_LEVELS];
+    u64 size;
+};
+static_assert(sizeof(TextureCacheHeader) == 32 + 24 * MAX_TEXTURE_LEVELS + 8, "TextureCacheHeader must not be padded");
+
+// True if the header describes exactly the layout processTexture would have
+// produced and fileSize holds all of it. Anything else is a stale or damaged
+// entry and must not reach the staging buffer copy.
+bool
+isTextureCacheHeaderValid(
+    TextureCacheHeader& header,
+    u64 fileSize
+) {
+    if (memcmp(header.magic, TEXTURE_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TEXTURE_CACHE_VERSION) {
+        return false;
+    }
+    if (header.format != VK_FORMAT_R8G8B8A8_UNORM &&
+        header.format != VK_FORMAT_BC1_RGBA_UNORM_BLOCK &&
+        header.format != VK_FORMAT_BC3_UNORM_BLOCK) {
+        return false;
+    }
+    if (header.width == 0 || header.width > MAX_CACHED_TEXTURE_SIZE ||
+        header.height == 0 || header.height > MAX_CACHED_TEXTURE_SIZE) {
+        return false;
+    }
+    if (header.levelCount != 1 &&
+        header.levelCount != getFullLevelCount(header.width, header.height)) {
+        return false;
+    }
+
+    ProcessedTexture expected = {};
+    expected.format = (VkFormat)header.format;
+    expected.width = header.width;
+    expected.height = header.height;
+    expected.levelCount = header.levelCount;
+    layoutTextureLevels(expected);
+    if (header.size != expected.size || fileSize != sizeof(header) + expected.size) {
+        return false;
+    }
+    for (u32 i = 0; i < header.levelCount; i++) {
+        auto& level = header.levels[i];
+        auto& expectedLevel = expected.levels[i];
+        if (level.width != expectedLevel.width ||
+            level.height != expectedLevel.height ||
+            level.offset != expectedLevel.offset ||
+            level.size != expectedLevel.size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Key for a processed texture: FNV-1a over the source file, mixed with the
+// settings that affect the output.
+u64
+getTextureCacheKey(
+    u8* source,
+    u32 sourceSize,
+    TextureSettings& settings
+) {
+    u64 hash = 14695981039346656037ull;
+    for (u32 i = 0; i < sourceSize; i++) {
+        hash ^= source[i];
+        hash *= 1099511628211ull;
+    }
+    hash ^= (u64)settings.mipFilter << 8 | (u64)settings.compress;
+    hash *= 1099511628211ull;
+    return hash;
+}
+
+void
+getTextureCachePath(
+    u64 key,
+    char* path,
+    size_t pathSize
+) {
+    sprintf_s(path, pathSize, "%s/%016llx.tex", TEXTURE_CACHE_DIR, key);
+}
+
+bool
+readTextureCache(
+    u64 key,
+    ProcessedTexture& result
+) {
+    char path[MAX_PATH];
+    getTextureCachePath(key, path, sizeof(path));
+    struct _stat stat = {};
+    FILE* file;
+    if (_stat(path, &stat) != 0 || fopen_s(&file, path, "rb") != 0) {
+        return false;
+    }
+
+    TextureCacheHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+        isTextureCacheHeaderValid(header, (u64)stat.st_size);
+    if (valid) {
+        result = {};
+        result.format = (VkFormat)header.format;
+        result.width = header.width;
+        result.height = header.height;
+        result.levelCount = header.levelCount;
+        result.hasAlpha = header.hasAlpha != 0;
+        memcpy(result.levels, header.levels, sizeof(header.levels));
+        result.size = header.size;
+        result.data = (u8*)malloc(header.size);
+        result.fromCache = true;
+        valid = fread(result.data, 1, header.size, file) == header.size;
+        if (!valid) {
+            free(result.data);
+            result = {};
+        }
+    }
+    fclose(file);
+    if (!valid) {
+        ERR("ignoring invalid texture cache entry '%s'", path);
+    }
+    return valid;
+}
+
+void
+writeTextureCache(
+    u64 key,
+    ProcessedTexture& texture
+) {
+    char path[MAX_PATH];
+    getTextureCachePath(key, path, sizeof(path));
+
+    // NOTE: Two jobs can process the same texture at once, so each writes its
+    // own temporary file and renames it into place. Readers only ever see a
+    // complete entry.
+    char tempPath[MAX_PATH];
+    sprintf_s(tempPath, sizeof(tempPath), "%s.%lu.tmp", path, GetCurrentThreadId());
+    FILE* file;
+    if (fopen_s(&file, tempPath, "wb") != 0) {
+        ERR("could not write texture cache entry '%s'", tempPath);
+        return;
+    }
+
+    TextureCacheHeader header = {};
+    memcpy(header.magic, TEXTURE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = TEXTURE_CACHE_VERSION;
+    header.format = texture.format;
+    header.width = texture.width;
+    header.height = texture.height;
+    header.levelCount = texture.levelCount;
+    header.hasAlpha = texture.hasAlpha;
+    memcpy(header.levels, texture.levels, sizeof(header.levels));
+    header.size = texture.size;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(texture.data, 1, texture.size, file) == texture.size;
+    written = fclose(file) == 0 && written;
+    if (!written || !MoveFileEx(tempPath, path, MOVEFILE_REPLACE_EXISTING)) {
+        ERR("could not write texture cache entry '%s'", path);
+        DeleteFile(tempPath);
+    }
+}
+
+void
+initTextureCache() {
+    if (!CreateDirectory(TEXTURE_CACHE_DIR, NULL) &&
+        GetLastError() != ERROR_ALREADY_EXISTS) {
+        ERR("could not create texture cache directory '%s'", TEXTURE_CACHE_DIR);
+    }
+}
+
+// True if the device can sample the block-compressed formats processTexture
+// produces.
+bool
+supportsBlockCompression(
+    Vulkan& vk
+) {
+    VkPhysicalDeviceFeatures features;
+    vkGetPhysicalDeviceFeatures(vk.gpu, &features);
+    if (!features.textureCompressionBC) {
+        return false;
+    }
+    VkFormat formats[] = {
+        VK_FORMAT_BC1_RGBA_UNORM_BLOCK,
+        VK_FORMAT_BC3_UNORM_BLOCK
+    };
+    for (auto format: formats) {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(vk.gpu, format, &properties);
+        if (!(properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Everything an upload in flight holds on to until the GPU is done with it.
+struct TextureUpload {
+    VulkanBuffer staging;
+    VkCommandBuffer cmd;
+    VkFence fence;
+    // Device memory taken by the image.
+    VkDeviceSize memorySize;
+    // Where the staging buffer is accounted.
+    MemoryUsage* memory;
+};
+
+void
+initTextureImageInfo(
+    ProcessedTexture& texture,
+    VkImageCreateInfo& createInfo
+) {
+    createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    createInfo.imageType = VK_IMAGE_TYPE_2D;
+    createInfo.format = texture.format;
+    createInfo.extent = { texture.width, texture.height, 1 };
+    createInfo.mipLevels = texture.levelCount;
+    createInfo.arrayLayers = 1;
+    createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    createInfo.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+    createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+}
+
+// Device memory that beginTextureUpload will allocate for texture. Images
+// created with the same parameters have the same memory requirements, so this
+// matches TextureUpload::memorySize exactly.
+VkDeviceSize
+getTextureMemorySize(
+    Vulkan& vk,
+    ProcessedTexture& texture
+) {
+    VkImageCreateInfo createInfo;
+    initTextureImageInfo(texture, createInfo);
+    VkImage image;
+    VKCHECK(vkCreateImage(vk.device, &createInfo, nullptr, &image));
+    VkMemoryRequirements requirements;
+    vkGetImageMemoryRequirements(vk.device, image, &requirements);
+    vkDestroyImage(vk.device, image, nullptr);
+    return requirements.size;
+}
+
+// Submits the upload of every level of a processed texture through a staging
+// buffer and creates a trilinear sampler covering the whole mip chain. Returns
+// without waiting: later submissions on the queue see the finished image, and
+// finishTextureUpload releases the staging resources once the copy is done.
+// The image and staging buffer are accounted in memory.
+void
+beginTextureUpload(
+    Vulkan& vk,
+    ProcessedTexture& texture,
+    VulkanSampler& sampler,
+    TextureUpload& upload,
+    MemoryUsage* memory
+) {
+    upload = {};
+    upload.memory = memory;
+    auto& staging = upload.staging;
+    createBuffer(
+        vk,
+        texture.size,
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        staging,
+        memory,
+        MEMORY_STAGING
+    );
+    void* mapped;
+    VKCHECK(vkMapMemory(vk.device, staging.memory, 0, texture.size, 0, &mapped));
+    memcpy(mapped, texture.data, texture.size);
+    vkUnmapMemory(vk.device, staging.memory);
+
+    auto& image = sampler.image;
+    {
+        VkImageCreateInfo createInfo;
+        initTextureImageInfo(texture, createInfo);
+        VKCHECK(vkCreateImage(vk.device, &createInfo, nullptr, &image.handle));
+
+        VkMemoryRequirements requirements;
+        vkGetImageMemoryRequirements(vk.device, image.handle, &requirements);
+        VkMemoryAllocateInfo allocateInfo = {};
+        allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocateInfo.allocationSize = requirements.size;
+        allocateInfo.memoryTypeIndex = findMemoryType(
+            vk.memories,
+            requirements.memoryTypeBits,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+        );
+        VKCHECK(vkAllocateMemory(vk.device, &allocateInfo, nullptr, &image.memory));
+        VKCHECK(vkBindImageMemory(vk.device, image.handle, image.memory, 0));
+        upload.memorySize = requirements.size;
+        trackDeviceMemory(memory, MEMORY_TEXTURES, requirements.size);
+    }
+
+    auto& cmd = upload.cmd;
+    {
+        VkCommandBufferAllocateInfo allocateInfo = {};
+        allocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocateInfo.commandPool = vk.cmdPoolTransient;
+        allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocateInfo.commandBufferCount = 1;
+        VKCHECK(vkAllocateCommandBuffers(vk.device, &allocateInfo, &cmd));
+
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        VKCHECK(vkBeginCommandBuffer(cmd, &beginInfo));
+    }
+
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image.handle;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = texture.levelCount;
+    barrier.subresourceRange.layerCount = 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(
+        cmd,
+        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0,
+        0, nullptr,
+        0, nullptr,
+        1, &barrier
+    );
+
+    VkBufferImageCopy regions[MAX_TEXTURE_LEVELS] = {};
+    for (u32 i = 0; i < texture.levelCount; i++) {
+        auto& region = regions[i];
+        region.bufferOffset = texture.levels[i].offset;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = i;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent = { texture.levels[i].width, texture.levels[i].height, 1 };
+    }
+    vkCmdCopyBufferToImage(
+        cmd,
+        staging.handle,
+        image.handle,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        texture.levelCount,
+        regions
+    );
+
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(
+        cmd,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0,
+        0, nullptr,
+        0, nullptr,
+        1, &barrier
+    );
+
+    VKCHECK(vkEndCommandBuffer(cmd));
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cmd;
+    VkFenceCreateInfo fenceInfo = {};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VKCHECK(vkCreateFence(vk.device, &fenceInfo, nullptr, &upload.fence));
+    VKCHECK(vkQueueSubmit(vk.queue, 1, &submitInfo, upload.fence));
+
+    {
+        VkImageViewCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        createInfo.image = image.handle;
+        createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        createInfo.format = texture.format;
+        createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        createInfo.subresourceRange.levelCount = texture.levelCount;
+        createInfo.subresourceRange.layerCount = 1;
+        VKCHECK(vkCreateImageView(vk.device, &createInfo, nullptr, &image.view));
+    }
+
+    {
+        VkSamplerCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        createInfo.magFilter = VK_FILTER_LINEAR;
+        createInfo.minFilter = VK_FILTER_LINEAR;
+        createInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+        createInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        createInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        createInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+        createInfo.minLod = 0;
+        createInfo.maxLod = (float)texture.levelCount;
+        createInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+        VKCHECK(vkCreateSampler(vk.device, &createInfo, nullptr, &sampler.handle));
+    }
+}
+
+// Frees the staging resources of an upload once the GPU has finished with
+// them. Returns false if it has not yet and wait is false.
+bool
+finishTextureUpload(
+    Vulkan& vk,
+    TextureUpload& upload,
+    bool wait
+) {
+    if (wait) {
+        VKCHECK(vkWaitForFences(vk.device, 1, &upload.fence, VK_TRUE, UINT64_MAX));
+    } else if (vkGetFenceStatus(vk.device, upload.fence) != VK_SUCCESS) {
+        return false;
+    }
+    vkDestroyFence(vk.device, upload.fence, nullptr);
+    vkFreeCommandBuffers(vk.device, vk.cmdPoolTransient, 1, &upload.cmd);
+    destroyBuffer(vk, upload.staging, upload.memory, MEMORY_STAGING);
+    upload.fence = VK_NULL_HANDLE;
+    return true;
+}
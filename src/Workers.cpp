@@ -0,0 +1,677 @@
+#include <emmintrin.h>
+#include <math.h>
+
+// NOTE: A work-stealing job system. Every thread of the pool, the one that
+// created it included, owns a deque of jobs: it pushes and pops at the bottom
+// while idle threads steal from the top (Chase-Lev). Work that may take long,
+// like loading a map or decoding a texture, goes to a shared background queue
+// instead. Only idle worker threads take from it, and a thread waiting for a
+// counter only runs jobs from its own deque, so per-frame work never ends up
+// stuck behind a map load. A pool always has at least one worker thread, so
+// background work never runs on the thread that queued it.
+const u32 JOB_DEQUE_SIZE = 4096;
+// parallelFor splits its range into this many chunks per thread so that
+// threads that finish early have something left to steal.
+const u32 CHUNKS_PER_THREAD = 4;
+const u32 MAX_PARALLEL_CHUNKS = 128;
+// Rounds of _mm_pause a thread spins for before it yields or sleeps.
+const u32 JOB_SPIN_COUNT = 256;
+
+struct Job;
+
+// Counts jobs that have not finished yet. Jobs queued with runJobAfter wait
+// for one to reach zero.
+struct JobCounter {
+    std::atomic<u32> pending{0};
+    // Guards continuations. finishJob decrements pending with it held, so a
+    // waiter that takes it once after seeing zero knows the counter is no
+    // longer in use and can be destroyed.
+    std::mutex mutex;
+    Job* continuations = nullptr;
+};
+
+typedef void JobEntry(Job& job);
+
+struct Job {
+    JobEntry* entry;
+    void* data;
+    u32 begin;
+    u32 end;
+    JobCounter* counter;
+    // Next continuation waiting on the same counter.
+    Job* next;
+    bool background;
+    // Jobs made by makeJob are freed once they have run. parallelFor's live
+    // on the caller's stack.
+    bool owned;
+};
+
+struct JobDeque {
+    alignas(64) std::atomic<i64> top;
+    alignas(64) std::atomic<i64> bottom;
+    std::atomic<Job*> jobs[JOB_DEQUE_SIZE];
+};
+
+struct WorkerPool {
+    std::vector<std::thread> threads;
+    // One per thread, the creating thread's first.
+    JobDeque** deques;
+    // Threads that run per-frame work. A pool of one also has a thread past
+    // these that only runs background jobs and what they queue themselves.
+    u32 threadCount;
+    std::mutex mutex;
+    std::condition_variable wake;
+    // Guarded by mutex.
+    Job** background;
+    bool quit;
+    // Jobs queued and not taken yet, so that threads know when to sleep.
+    std::atomic<i32> queued;
+    std::atomic<u32> sleeping;
+    // What the creating thread belonged to before this pool.
+    WorkerPool* previousPool;
+    u32 previousIndex;
+};
+
+thread_local WorkerPool* currentPool;
+thread_local u32 currentIndex;
+
+bool
+pushJob(
+    JobDeque& deque,
+    Job* job
+) {
+    i64 bottom = deque.bottom.load(std::memory_order_relaxed);
+    i64 top = deque.top.load(std::memory_order_acquire);
+    if (bottom - top >= JOB_DEQUE_SIZE) {
+        return false;
+    }
+    deque.jobs[bottom & (JOB_DEQUE_SIZE - 1)].store(job, std::memory_order_relaxed);
+    deque.bottom.store(bottom + 1, std::memory_order_release);
+    return true;
+}
+
+// NOTE: The owner and the thieves agree on who gets the last job through the
+// sequentially consistent accesses to top and bottom. They stand in for the
+// fences of the original algorithm, which ThreadSanitizer does not model.
+Job*
+popJob(
+    JobDeque& deque
+) {
+    i64 bottom = deque.bottom.load(std::memory_order_relaxed) - 1;
+    deque.bottom.store(bottom, std::memory_order_seq_cst);
+    i64 top = deque.top.load(std::memory_order_seq_cst);
+    if (top > bottom) {
+        deque.bottom.store(bottom + 1, std::memory_order_release);
+        return nullptr;
+    }
+    Job* job = deque.jobs[bottom & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+    if (top == bottom) {
+        if (!deque.top.compare_exchange_strong(
+            top, top + 1,
+            std::memory_order_seq_cst,
+            std::memory_order_relaxed
+        )) {
+            job = nullptr;
+        }
+        deque.bottom.store(bottom + 1, std::memory_order_release);
+    }
+    return job;
+}
+
+Job*
+stealJob(
+    JobDeque& deque
+) {
+    i64 top = deque.top.load(std::memory_order_seq_cst);
+    i64 bottom = deque.bottom.load(std::memory_order_seq_cst);
+    if (top >= bottom) {
+        return nullptr;
+    }
+    Job* job = deque.jobs[top & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+    if (!deque.top.compare_exchange_strong(
+        top, top + 1,
+        std::memory_order_seq_cst,
+        std::memory_order_relaxed
+    )) {
+        return nullptr;
+    }
+    return job;
+}
+
+void
+wakeWorkers(
+    WorkerPool& pool,
+    bool all
+) {
+    if (pool.sleeping.load() == 0) return;
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (all) {
+        pool.wake.notify_all();
+    } else {
+        pool.wake.notify_one();
+    }
+}
+
+void submitJob(WorkerPool& pool, Job* job);
+
+void
+finishJob(
+    WorkerPool& pool,
+    JobCounter* counter
+) {
+    if (counter == nullptr) return;
+    Job* ready = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(counter->mutex);
+        if (--counter->pending == 0) {
+            ready = counter->continuations;
+            counter->continuations = nullptr;
+        }
+    }
+    while (ready != nullptr) {
+        Job* next = ready->next;
+        submitJob(pool, ready);
+        ready = next;
+    }
+}
+
+void
+executeJob(
+    WorkerPool& pool,
+    Job* job
+) {
+    JobCounter* counter = job->counter;
+    job->entry(*job);
+    if (job->owned) {
+        delete (std::function<void()>*)job->data;
+        delete job;
+    }
+    finishJob(pool, counter);
+}
+
+// Queues job on the calling thread's deque, or runs it right away if the
+// deque is full.
+void
+submitJob(
+    WorkerPool& pool,
+    Job* job
+) {
+    if (job->background) {
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            arrput(pool.background, job);
+            pool.queued++;
+        }
+        pool.wake.notify_one();
+        return;
+    }
+
+    CHECK(currentPool == &pool, "job submitted from a thread outside its pool");
+    pool.queued++;
+    if (!pushJob(*pool.deques[currentIndex], job)) {
+        pool.queued--;
+        executeJob(pool, job);
+        return;
+    }
+    wakeWorkers(pool, false);
+}
+
+// Takes the next job for thread index: its own newest, else the oldest of
+// another thread, else the oldest background job. The background thread of a
+// pool of one does not steal.
+Job*
+findJob(
+    WorkerPool& pool,
+    u32 index
+) {
+    Job* job = popJob(*pool.deques[index]);
+    for (u32 i = 1; job == nullptr && index < pool.threadCount && i < pool.threadCount; i++) {
+        job = stealJob(*pool.deques[(index + i) % pool.threadCount]);
+    }
+    if (job == nullptr) {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (arrlen(pool.background) > 0) {
+            job = pool.background[0];
+            arrdel(pool.background, 0);
+        }
+    }
+    if (job != nullptr) {
+        pool.queued--;
+    }
+    return job;
+}
+
+void
+workerThread(
+    WorkerPool* pool,
+    u32 index
+) {
+    currentPool = pool;
+    currentIndex = index;
+    bool backgroundOnly = index >= pool->threadCount;
+    for (;;) {
+        Job* job = findJob(*pool, index);
+        if (job != nullptr) {
+            executeJob(*pool, job);
+            continue;
+        }
+        for (u32 i = 0; i < JOB_SPIN_COUNT && !backgroundOnly && pool->queued.load() <= 0; i++) {
+            _mm_pause();
+        }
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->sleeping++;
+        // NOTE: Jobs on the other deques are not for the background thread,
+        // so it only wakes up for background work.
+        pool->wake.wait(lock, [&]() {
+            if (pool->quit) return true;
+            if (backgroundOnly) return arrlen(pool->background) > 0;
+            return pool->queued.load() > 0;
+        });
+        pool->sleeping--;
+        if (pool->quit) return;
+    }
+}
+
+// Starts threadCount - 1 workers, the thread creating the pool being the
+// last one. A threadCount of 0 uses one thread per core. A pool of one still
+// starts a thread for background jobs, so that a map load or a texture decode
+// never runs on the thread that asked for it.
+void
+createWorkerPool(
+    u32 threadCount,
+    WorkerPool& pool
+) {
+    if (threadCount == 0) {
+        threadCount = std::thread::hardware_concurrency();
+    }
+    if (threadCount < 1) threadCount = 1;
+    u32 startedCount = threadCount > 1 ? threadCount : 2;
+    pool.threadCount = threadCount;
+    pool.deques = NULL;
+    for (u32 i = 0; i < startedCount; i++) {
+        auto deque = new JobDeque;
+        deque->top = 0;
+        deque->bottom = 0;
+        arrput(pool.deques, deque);
+    }
+    pool.background = NULL;
+    pool.quit = false;
+    pool.queued = 0;
+    pool.sleeping = 0;
+    pool.previousPool = currentPool;
+    pool.previousIndex = currentIndex;
+    currentPool = &pool;
+    currentIndex = 0;
+    for (u32 i = 1; i < startedCount; i++) {
+        pool.threads.emplace_back(workerThread, &pool, i);
+    }
+}
+
+// Every job must have finished.
+void
+destroyWorkerPool(
+    WorkerPool& pool
+) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.quit = true;
+    }
+    pool.wake.notify_all();
+    for (auto& thread: pool.threads) {
+        thread.join();
+    }
+    pool.threads.clear();
+    for (int i = 0; i < arrlen(pool.deques); i++) {
+        delete pool.deques[i];
+    }
+    arrfree(pool.deques);
+    arrfree(pool.background);
+    currentPool = pool.previousPool;
+    currentIndex = pool.previousIndex;
+}
+
+u32
+getWorkerCount(
+    WorkerPool& pool
+) {
+    return pool.threadCount;
+}
+
+void
+runFunctionJob(
+    Job& job
+) {
+    (*(std::function<void()>*)job.data)();
+}
+
+Job*
+makeJob(
+    std::function<void()>& function,
+    JobCounter* counter,
+    bool background
+) {
+    if (counter != nullptr) {
+        counter->pending++;
+    }
+    Job* job = new Job;
+    job->entry = runFunctionJob;
+    job->data = new std::function<void()>(std::move(function));
+    job->begin = 0;
+    job->end = 0;
+    job->counter = counter;
+    job->next = nullptr;
+    job->background = background;
+    job->owned = true;
+    return job;
+}
+
+// Queues function to run on any thread of the pool. counter, if not null,
+// counts it until it has finished.
+void
+runJob(
+    WorkerPool& pool,
+    std::function<void()> function,
+    JobCounter* counter
+) {
+    submitJob(pool, makeJob(function, counter, false));
+}
+
+// Like runJob, for work that may take long enough to hold up a frame.
+void
+runBackgroundJob(
+    WorkerPool& pool,
+    std::function<void()> function,
+    JobCounter* counter
+) {
+    submitJob(pool, makeJob(function, counter, true));
+}
+
+// Queues function once every job counted by dependency has finished.
+void
+runJobAfter(
+    WorkerPool& pool,
+    JobCounter& dependency,
+    std::function<void()> function,
+    JobCounter* counter
+) {
+    Job* job = makeJob(function, counter, false);
+    {
+        std::lock_guard<std::mutex> lock(dependency.mutex);
+        if (dependency.pending.load() != 0) {
+            job->next = dependency.continuations;
+            dependency.continuations = job;
+            return;
+        }
+    }
+    submitJob(pool, job);
+}
+
+// Runs jobs from the calling thread's own deque until counter reaches zero.
+void
+waitForCounter(
+    WorkerPool& pool,
+    JobCounter& counter
+) {
+    u32 spins = 0;
+    while (counter.pending.load(std::memory_order_acquire) != 0) {
+        Job* job = nullptr;
+        if (currentPool == &pool) {
+            job = popJob(*pool.deques[currentIndex]);
+        }
+        if (job != nullptr) {
+            pool.queued--;
+            executeJob(pool, job);
+            spins = 0;
+        } else if (++spins < JOB_SPIN_COUNT) {
+            _mm_pause();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    std::lock_guard<std::mutex> lock(counter.mutex);
+}
+
+void
+runParallelForChunk(
+    Job& job
+) {
+    auto& task = *(std::function<void(u32)>*)job.data;
+    for (u32 i = job.begin; i < job.end; i++) {
+        task(i);
+    }
+}
+
+// Calls task(i) for every i in [0, count) across the pool and returns once
+// all calls have finished. Can be called from inside other jobs.
+void
+parallelFor(
+    WorkerPool& pool,
+    u32 count,
+    std::function<void(u32)> task
+) {
+    u32 chunkCount = pool.threadCount * CHUNKS_PER_THREAD;
+    if (chunkCount > MAX_PARALLEL_CHUNKS) chunkCount = MAX_PARALLEL_CHUNKS;
+    if (chunkCount > count) chunkCount = count;
+    if (chunkCount <= 1) {
+        for (u32 i = 0; i < count; i++) {
+            task(i);
+        }
+        return;
+    }
+    CHECK(currentPool == &pool, "parallelFor called from a thread outside its pool");
+
+    JobCounter counter;
+    counter.pending = chunkCount;
+    Job jobs[MAX_PARALLEL_CHUNKS];
+    u32 begin = 0;
+    for (u32 c = 0; c < chunkCount; c++) {
+        u32 size = count / chunkCount + (c < count % chunkCount ? 1 : 0);
+        auto& job = jobs[c];
+        job.entry = runParallelForChunk;
+        job.data = &task;
+        job.begin = begin;
+        job.end = begin + size;
+        job.counter = &counter;
+        job.next = nullptr;
+        job.background = false;
+        job.owned = false;
+        begin += size;
+    }
+
+    // Queue every chunk before waking anyone, then work on them from the
+    // newest end while the other threads steal from the oldest.
+    auto& deque = *pool.deques[currentIndex];
+    for (u32 c = 0; c < chunkCount; c++) {
+        pool.queued++;
+        if (!pushJob(deque, &jobs[c])) {
+            pool.queued--;
+            executeJob(pool, &jobs[c]);
+        }
+    }
+    wakeWorkers(pool, true);
+    waitForCounter(pool, counter);
+}
+
+// Reports how much a job costs and how parallelFor scales with pools of 1, 2,
+// 4, ... threads up to maxThreads.
+void
+benchmarkJobs(
+    u32 maxThreads
+) {
+    if (maxThreads == 0) {
+        maxThreads = std::thread::hardware_concurrency();
+    }
+    if (maxThreads < 1) maxThreads = 1;
+    auto elapsedMS = [](LARGE_INTEGER& start) {
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&end);
+        return (end.QuadPart - start.QuadPart) * 1000.0 / counterFrequency.QuadPart;
+    };
+
+    // Overhead of queueing and running an empty job, and of a parallelFor
+    // with one empty task per thread.
+    for (u32 threads = 1; ; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+        WorkerPool pool;
+        createWorkerPool(threads, pool);
+
+        const u32 jobCount = 100000;
+        std::atomic<u32> ran{0};
+        JobCounter counter;
+        LARGE_INTEGER start;
+        QueryPerformanceCounter(&start);
+        for (u32 i = 0; i < jobCount; i++) {
+            runJob(pool, [&]() { ran.fetch_add(1, std::memory_order_relaxed); }, &counter);
+            if (counter.pending.load() >= JOB_DEQUE_SIZE / 2) {
+                waitForCounter(pool, counter);
+            }
+        }
+        waitForCounter(pool, counter);
+        double jobMS = elapsedMS(start);
+        CHECK(ran.load() == jobCount, "lost jobs");
+
+        const u32 forCount = 10000;
+        QueryPerformanceCounter(&start);
+        for (u32 i = 0; i < forCount; i++) {
+            parallelFor(pool, threads, [&](u32) { ran.fetch_add(1, std::memory_order_relaxed); });
+        }
+        double forMS = elapsedMS(start);
+
+        INFO(
+            "Jobs on %u threads: %.0f ns per job, %.2f us per parallelFor",
+            threads,
+            jobMS * 1e6 / jobCount,
+            forMS * 1e3 / forCount
+        );
+        destroyWorkerPool(pool);
+        if (threads >= maxThreads) break;
+    }
+
+    // Scaling of a compute-bound parallelFor.
+    const u32 itemCount = 1 << 16;
+    float* results = (float*)malloc(itemCount * sizeof(float));
+    double baseMS = 0;
+    for (u32 threads = 1; ; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+        WorkerPool pool;
+        createWorkerPool(threads, pool);
+        LARGE_INTEGER start;
+        QueryPerformanceCounter(&start);
+        for (u32 round = 0; round < 10; round++) {
+            parallelFor(pool, itemCount, [&](u32 i) {
+                float x = (float)i;
+                for (u32 j = 0; j < 256; j++) {
+                    x = sqrtf(x * x + 1.f);
+                }
+                results[i] = x;
+            });
+        }
+        double ms = elapsedMS(start) / 10;
+        if (threads == 1) baseMS = ms;
+        INFO(
+            "parallelFor over %u items on %u threads: %.3f ms (%.2fx)",
+            itemCount,
+            threads,
+            ms,
+            ms > 0 ? baseMS / ms : 0.0
+        );
+        destroyWorkerPool(pool);
+        if (threads >= maxThreads) break;
+    }
+    free(results);
+}
+
+// NOTE: Hammers the pool with nested parallelFor, dependency chains,
+// background jobs and more jobs than a deque holds, checking every result.
+// Meant to be run under a race detector as much as on its own.
+void
+stressJobPool(
+    u32 threadCount,
+    u32 rounds
+) {
+    WorkerPool pool;
+    createWorkerPool(threadCount, pool);
+    u32 seed = 0x9e3779b9;
+    auto random = [&](u32 range) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed % range;
+    };
+
+    u32* values = NULL;
+    u64 taskCount = 0;
+    for (u32 round = 1; round <= rounds; round++) {
+        // Every index written exactly once, and visible once parallelFor
+        // returns.
+        u32 count = 1 + random(20000);
+        arrsetlen(values, count);
+        parallelFor(pool, count, [&](u32 i) { values[i] = round; });
+        for (u32 i = 0; i < count; i++) {
+            CHECK(values[i] == round, "parallelFor missed index %u", i);
+        }
+
+        // Nested parallelFor.
+        u32 outer = 1 + random(64);
+        u32 inner = 1 + random(256);
+        std::atomic<u32> sum{0};
+        parallelFor(pool, outer, [&](u32) {
+            parallelFor(pool, inner, [&](u32 i) { sum.fetch_add(i + 1); });
+        });
+        CHECK(sum.load() == outer * inner * (inner + 1) / 2, "nested parallelFor lost tasks");
+
+        // A diamond of dependencies: b and c read what a wrote and d reads
+        // what they wrote, without any atomics of their own.
+        u32 a = 0, b = 0, c = 0, d = 0;
+        JobCounter first, second, last;
+        runJob(pool, [&]() { a = round; }, &first);
+        runJobAfter(pool, first, [&]() { b = a + 1; }, &second);
+        runJobAfter(pool, first, [&]() { c = a + 2; }, &second);
+        runJobAfter(pool, second, [&]() { d = b + c; }, &last);
+        waitForCounter(pool, last);
+        waitForCounter(pool, second);
+        waitForCounter(pool, first);
+        CHECK(d == 2 * round + 3, "dependent jobs ran out of order");
+
+        // Background jobs spawning frame work, and more jobs than fit in a
+        // deque.
+        JobCounter background;
+        std::atomic<u32> ran{0};
+        for (u32 i = 0; i < 4; i++) {
+            runBackgroundJob(pool, [&]() {
+                parallelFor(pool, 100, [&](u32) { ran++; });
+            }, &background);
+        }
+        JobCounter many;
+        u32 manyCount = JOB_DEQUE_SIZE + random(JOB_DEQUE_SIZE);
+        for (u32 i = 0; i < manyCount; i++) {
+            runJob(pool, [&]() { ran++; }, &many);
+        }
+        waitForCounter(pool, many);
+        waitForCounter(pool, background);
+        CHECK(ran.load() == 400 + manyCount, "jobs went missing");
+        taskCount += count + outer * inner + 4 + 4 + 400 + manyCount;
+    }
+    arrfree(values);
+    destroyWorkerPool(pool);
+    INFO(
+        "Job stress test passed on %u threads: %u rounds, %llu tasks",
+        threadCount,
+        rounds,
+        taskCount
+    );
+}
+
+// Runs the stress test with pools of 1, 2, 4, ... threads up to maxThreads.
+void
+stressJobs(
+    u32 maxThreads,
+    u32 rounds
+) {
+    if (maxThreads == 0) {
+        maxThreads = std::thread::hardware_concurrency();
+    }
+    if (maxThreads < 1) maxThreads = 1;
+    for (u32 threads = 1; ; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+        stressJobPool(threads, rounds);
+        if (threads >= maxThreads) break;
+    }
+}
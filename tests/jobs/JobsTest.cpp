@@ -0,0 +1,102 @@
+// NOTE: Runs the job system stress test outside the viewer, so that it builds
+// anywhere Workers.cpp does and can be checked with ThreadSanitizer (the
+// KWARK_TSAN CMake option). Usage: jobs_test [rounds] [threads].
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t i32;
+typedef int64_t i64;
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <time.h>
+
+struct LARGE_INTEGER {
+    i64 QuadPart;
+};
+
+void
+QueryPerformanceCounter(
+    LARGE_INTEGER* counter
+) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counter->QuadPart = (i64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void
+QueryPerformanceFrequency(
+    LARGE_INTEGER* frequency
+) {
+    frequency->QuadPart = 1000000000;
+}
+#endif
+
+LARGE_INTEGER counterFrequency;
+
+#define INFO(...) (printf(__VA_ARGS__), printf("\n"), fflush(stdout))
+#define ERR(...) (fprintf(stderr, __VA_ARGS__), fprintf(stderr, "\n"))
+#define FATAL(...) do { ERR(__VA_ARGS__); exit(1); } while (0)
+#define CHECK(condition, ...) do { if (!(condition)) FATAL(__VA_ARGS__); } while (0)
+
+#define STB_DS_IMPLEMENTATION
+#include "stb_ds.h"
+
+#include "Workers.cpp"
+
+// A pool of one must still run background jobs, and what they queue, on a
+// thread other than the one that submitted them.
+void
+testBackgroundJobs() {
+    WorkerPool pool;
+    createWorkerPool(1, pool);
+    auto caller = std::this_thread::get_id();
+    std::atomic<u32> onCaller{0};
+    std::atomic<u32> ran{0};
+    JobCounter counter;
+    const u32 jobCount = 1000;
+    for (u32 i = 0; i < jobCount; i++) {
+        runBackgroundJob(pool, [&]() {
+            if (std::this_thread::get_id() == caller) {
+                onCaller++;
+            }
+            std::atomic<u32> inner{0};
+            parallelFor(pool, 16, [&](u32) { inner++; });
+            CHECK(inner.load() == 16, "parallelFor inside a background job lost tasks");
+            ran++;
+        }, &counter);
+    }
+    waitForCounter(pool, counter);
+    destroyWorkerPool(pool);
+    CHECK(ran.load() == jobCount, "background jobs lost: %u of %u ran", ran.load(), jobCount);
+    CHECK(onCaller.load() == 0, "%u background jobs ran on the submitting thread", onCaller.load());
+    INFO("Background job test passed: %u jobs", jobCount);
+}
+
+int
+main(
+    int argc,
+    char** argv
+) {
+    QueryPerformanceFrequency(&counterFrequency);
+    u32 rounds = argc > 1 ? (u32)atoi(argv[1]) : 20;
+    u32 threads = argc > 2 ? (u32)atoi(argv[2]) : 0;
+
+    testBackgroundJobs();
+    stressJobs(threads, rounds);
+    return 0;
+}
@@ -0,0 +1,163 @@
+# Regenerates the JPEG fixtures for -jpegtest in this directory:
+#
+#     python3 generate.py
+#
+# Grey, 4:4:4, 4:2:2 and 4:2:0 files are written by libjpeg through Pillow.
+# Pillow cannot write 4:4:0, so those come from the small baseline encoder
+# below. Every image has a column and a row of alternating colours along its
+# right and bottom edges, where chroma upsampling bugs show up.
+import math, os, random, struct
+from PIL import Image
+
+out = os.path.dirname(os.path.abspath(__file__))
+
+ZIGZAG = [0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,
+          35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63]
+QL = [16,11,10,16,24,40,51,61,12,12,14,19,26,58,60,55,14,13,16,24,40,57,69,56,14,17,22,29,51,87,80,62,
+      18,22,37,56,68,109,103,77,24,35,55,64,81,104,113,92,49,64,78,87,103,121,120,101,72,92,95,98,112,100,103,99]
+QC = [17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99]+[99]*32
+DC_L_BITS=[0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0]; DC_L_VAL=list(range(12))
+DC_C_BITS=[0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0]; DC_C_VAL=list(range(12))
+AC_L_BITS=[0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d]
+AC_L_VAL=bytes.fromhex("01020300041105122131410613516107227114328191a1082342b1c11552d1f02433627282090a161718191a25262728292a3435363738393a434445464748494a535455565758595a636465666768696a737475767778797a838485868788898a92939495969798999aa2a3a4a5a6a7a8a9aab2b3b4b5b6b7b8b9bac2c3c4c5c6c7c8c9cad2d3d4d5d6d7d8d9dae1e2e3e4e5e6e7e8e9eaf1f2f3f4f5f6f7f8f9fa")
+AC_C_BITS=[0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77]
+AC_C_VAL=bytes.fromhex("000102031104052131061241510761711322328108144291a1b1c109233352f0156272d10a162434e125f11718191a262728292a35363738393a434445464748494a535455565758595a636465666768696a737475767778797a82838485868788898a92939495969798999aa2a3a4a5a6a7a8a9aab2b3b4b5b6b7b8b9bac2c3c4c5c6c7c8c9cad2d3d4d5d6d7d8d9dae2e3e4e5e6e7e8e9eaf2f3f4f5f6f7f8f9fa")
+
+def huff(bits, vals):
+    codes={}; code=0; k=0
+    for l in range(1,17):
+        for _ in range(bits[l-1]):
+            codes[vals[k]]=(code,l); code+=1; k+=1
+        code<<=1
+    return codes
+
+def scaleq(q, quality):
+    s = 5000/quality if quality<50 else 200-quality*2
+    return [max(1,min(255,(v*s+50)//100)) for v in q]
+
+class Bits:
+    def __init__(s): s.out=bytearray(); s.acc=0; s.n=0
+    def put(s,code,l):
+        s.acc=(s.acc<<l)|code; s.n+=l
+        while s.n>=8:
+            b=(s.acc>>(s.n-8))&255; s.out.append(b)
+            if b==255: s.out.append(0)
+            s.n-=8
+        s.acc&=(1<<s.n)-1
+    def flush(s):
+        if s.n: s.put((1<<(8-s.n))-1, 8-s.n)
+
+def fdct(block):
+    out=[0.0]*64
+    for v in range(8):
+        for u in range(8):
+            cu=1/math.sqrt(2) if u==0 else 1; cv=1/math.sqrt(2) if v==0 else 1
+            t=0.0
+            for y in range(8):
+                for x in range(8):
+                    t+=block[y*8+x]*math.cos((2*x+1)*u*math.pi/16)*math.cos((2*y+1)*v*math.pi/16)
+            out[v*8+u]=0.25*cu*cv*t
+    return out
+
+def catbits(v):
+    a=abs(v); n=a.bit_length()
+    return n, (v if v>=0 else v+(1<<n)-1)
+
+def encode(width, height, planes, sampling, quality=85, restart=0):
+    # planes: list of 2D lists (full resolution), sampling: [(h,v)...]
+    ql=scaleq(QL,quality); qc=scaleq(QC,quality)
+    hmax=max(h for h,v in sampling); vmax=max(v for h,v in sampling)
+    mcux=(width+8*hmax-1)//(8*hmax); mcuy=(height+8*vmax-1)//(8*vmax)
+    comps=[]
+    for ci,(plane,(h,v)) in enumerate(zip(planes,sampling)):
+        cw=mcux*h*8; ch=mcuy*v*8
+        fx=hmax//h; fy=vmax//v
+        data=[[0.0]*cw for _ in range(ch)]
+        for y in range(ch):
+            for x in range(cw):
+                acc=0.0
+                for dy in range(fy):
+                    for dx in range(fx):
+                        sx=min(x*fx+dx,width-1); sy=min(y*fy+dy,height-1)
+                        acc+=plane[sy][sx]
+                data[y][x]=acc/(fx*fy)
+        comps.append(data)
+    dcl=huff(DC_L_BITS,DC_L_VAL); acl=huff(AC_L_BITS,AC_L_VAL)
+    dcc=huff(DC_C_BITS,DC_C_VAL); acc_=huff(AC_C_BITS,AC_C_VAL)
+    bits=Bits(); pred=[0]*len(planes); mcus=0; rstn=0
+    for my in range(mcuy):
+        for mx in range(mcux):
+            if restart and mcus and mcus%restart==0:
+                bits.flush(); bits.out+=bytes([0xff,0xd0+rstn]); rstn=(rstn+1)&7; pred=[0]*len(planes)
+            mcus+=1
+            for ci,(h,v) in enumerate(sampling):
+                q=ql if ci==0 else qc; dc=dcl if ci==0 else dcc; ac=acl if ci==0 else acc_
+                for by in range(v):
+                    for bx in range(h):
+                        x0=(mx*h+bx)*8; y0=(my*v+by)*8
+                        blk=[comps[ci][y0+y][x0+x]-128 for y in range(8) for x in range(8)]
+                        co=fdct(blk)
+                        qz=[int(round(co[ZIGZAG[k]]/q[ZIGZAG[k]])) for k in range(64)]
+                        d=qz[0]-pred[ci]; pred[ci]=qz[0]
+                        n,b=catbits(d); bits.put(*dc[n]);
+                        if n: bits.put(b,n)
+                        run=0
+                        for k in range(1,64):
+                            if qz[k]==0: run+=1; continue
+                            while run>15: bits.put(*ac[0xf0]); run-=16
+                            n,b=catbits(qz[k]); bits.put(*ac[(run<<4)|n]); bits.put(b,n); run=0
+                        if run: bits.put(*ac[0])
+    bits.flush()
+    o=bytearray(b'\xff\xd8')
+    def seg(m,p): o.extend(bytes([0xff,m])+struct.pack('>H',len(p)+2)+p)
+    seg(0xdb, bytes([0])+bytes(ql[ZIGZAG[k]] for k in range(64)))
+    if len(planes)>1: seg(0xdb, bytes([1])+bytes(qc[ZIGZAG[k]] for k in range(64)))
+    sof=struct.pack('>BHHB',8,height,width,len(planes))
+    for ci,(h,v) in enumerate(sampling): sof+=bytes([ci+1,(h<<4)|v,0 if ci==0 else 1])
+    seg(0xc0,sof)
+    seg(0xc4,bytes([0x00])+bytes(DC_L_BITS)+bytes(DC_L_VAL))
+    seg(0xc4,bytes([0x10])+bytes(AC_L_BITS)+AC_L_VAL)
+    if len(planes)>1:
+        seg(0xc4,bytes([0x01])+bytes(DC_C_BITS)+bytes(DC_C_VAL))
+        seg(0xc4,bytes([0x11])+bytes(AC_C_BITS)+AC_C_VAL)
+    if restart: seg(0xdd,struct.pack('>H',restart))
+    sos=bytes([len(planes)])
+    for ci in range(len(planes)): sos+=bytes([ci+1,0x00 if ci==0 else 0x11])
+    sos+=bytes([0,63,0]); seg(0xda,sos)
+    o+=bits.out+b'\xff\xd9'
+    return bytes(o)
+
+def pattern(w,h,seed):
+    rnd=random.Random(seed)
+    img=Image.new('RGB',(w,h))
+    px=img.load()
+    cols=[(rnd.randrange(256),rnd.randrange(256),rnd.randrange(256)) for _ in range(16)]
+    for y in range(h):
+        for x in range(w):
+            # saturated columns of colour with a gradient, so chroma changes
+            # sharply at every edge including the last column and row
+            c=cols[((x*5)//max(w,1)*4+(y*4)//max(h,1))%16]
+            g=(x*255)//max(w-1,1)
+            px[x,y]=((c[0]+g)//2,(c[1]+255-g)//2,(c[2]*y)//max(h-1,1))
+    for x in range(w):
+        px[x,h-1]=(255,0,0) if x%2 else (0,0,255)
+    for y in range(h):
+        px[w-1,y]=(0,255,0) if y%2 else (255,0,255)
+    return img
+def save(name,img,**kw):
+    img.save(f'{out}/{name}.jpg',quality=90,**kw)
+sizes=[(64,48),(37,23),(9,17),(1,1)]
+for w,h in sizes:
+    img=pattern(w,h,w*h)
+    save(f'grey_{w}x{h}',img.convert('L'))
+    for ss,name in ((0,'444'),(1,'422'),(2,'420')):
+        save(f'{name}_{w}x{h}',img,subsampling=ss)
+    # 4:4:0 through the fixture encoder
+    r,g,b=img.split(); ycc=img.convert('YCbCr'); planes=[list(zip(*[iter(p.get_flattened_data())]*w)) for p in ycc.split()]
+    open(f'{out}/440_{w}x{h}.jpg','wb').write(encode(w,h,planes,[(1,2),(1,1),(1,1)],90))
+img=pattern(70,50,7)
+for ss,name in ((0,'444'),(1,'422'),(2,'420')):
+    save(f'{name}_70x50_restart',img,subsampling=ss,restart_marker_blocks=3)
+save('grey_70x50_restart',img.convert('L'),restart_marker_blocks=3)
+ycc=img.convert('YCbCr'); planes=[list(zip(*[iter(p.get_flattened_data())]*70)) for p in ycc.split()]
+open(f'{out}/440_70x50_restart.jpg','wb').write(encode(70,50,planes,[(1,2),(1,1),(1,1)],90,restart=3))